@@ -81,11 +81,24 @@
 #include <linux/spinlock.h>
 //#include <linux/semaphore.h>
 #include <linux/rwsem.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/jhash.h>
 #include <linux/usb/input.h>
 
 #include "map_to_7segment.h"
 #include "yealink.h"
+#include "yealink_ioctl.h"
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18)
 #error "Need kernel version 2.6.18 or higher"
@@ -105,12 +118,46 @@
 /* The following is the delay for polling the key matrix (G1 phones only) */
 #define YEALINK_POLLING_DELAY		100	/* in [ms] */
 
+/* After a key, hook or PSTN ring change the key matrix is polled with the
+   fast delay for the hold time, so dialing is not slowed down by the idle
+   polling rate (G1 phones only). */
+#define YEALINK_POLLING_DELAY_FAST	20	/* in [ms] */
+#define YEALINK_POLLING_HOLD		3000	/* in [ms] */
+
 /* The following is the delay between individual commands for
    LCD, Buzzer, ... (G2 phones only) to provide enough time for the
    handset to process the command. Otherwise effects like a partially
-   updated LCD were observed. */
+   updated LCD were observed. It is the default of the configurable gap,
+   which is timed with a high resolution timer. */
 #define YEALINK_COMMAND_DELAY_G2	25	/* in [ms] */
 
+/* Number of control URBs which can be queued at the same time. G1 phones
+   accept update commands back-to-back, so a full LCD repaint does not have
+   to wait for one USB round trip per packet. G2 phones only ever use one
+   of them due to the pacing described above. */
+#define YEALINK_CTL_QUEUE_LEN		4
+
+#define YEALINK_MINOR_BASE	192	/* first minor of /dev/yealinkN */
+
+#define YEALINK_FLUSH_TIMEOUT	5000	/* ms */
+#define YEALINK_QUIESCE_TIMEOUT	2000	/* ms */
+
+#define YEALINK_RING_NOTES_MAX	PAGE_SIZE	/* per ring notes buffer */
+#define YEALINK_RING_SLOTS	4	/* cached ringtones per device */
+
+#define YEALINK_KEY_BUF		32	/* scancodes buffered by G1 phones */
+
+#define YEALINK_RING_DEBOUNCE	100	/* ms, PSTN ring to call start */
+#define YEALINK_RING_END	6000	/* ms, no PSTN ring to call end */
+
+/* Incoming PSTN call. The input layer has no code for it, this one is not
+   mapped to a button of any model (KEY_R is REDIAL on the P4K). */
+#define YEALINK_KEY_PSTN_CALL	KEY_PROG1
+
+/* Number of log2 buckets of the latency histograms, the last bucket
+   collects everything from 2^(YLD_HIST_BUCKETS-2) us (~4s) upwards. */
+#define YLD_HIST_BUCKETS		24
+
 /* Make sure we have the following macros (independent of kernel versions) */
 #ifndef dev_info
 #define dev_info(dev, format, arg...) printk(KERN_INFO KBUILD_MODNAME ": " \
@@ -125,9 +172,36 @@
 #define fallthrough do {} while (0)  /* fallthrough */
 #endif
 
-/* for in-depth debugging */
-#define YEALINK_DBG_FLAGS(p) dev_dbg(&yld->intf->dev, "%s t=%d,u=%d,s=%d,p=%d",(p),yld->timer_expired,\
-				yld->update_active,yld->scan_active,yld->usb_pause)
+#ifndef __rcu
+#define __rcu
+#endif
+
+#ifndef rcu_dereference_protected
+#define rcu_dereference_protected(p, c) (p)
+#endif
+
+/* for in-depth debugging, see yealink_trace.h */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+#define CREATE_TRACE_POINTS
+#include "yealink_trace.h"
+#else
+#define trace_yealink_flags(...)	do {} while (0)
+#define trace_yealink_ctl_submit(...)	do {} while (0)
+#define trace_yealink_ctl_complete(...)	do {} while (0)
+#define trace_yealink_irq(...)		do {} while (0)
+#define trace_yealink_ring_notes(...)	do {} while (0)
+#endif
+
+#define YEALINK_TRACE_NOTES(p, b) trace_yealink_ring_notes(&yld->intf->dev, (p),\
+				(b), yld->notes_buf_len[b],\
+				yld->notes_buf_hash[b], yld->notes_ix,\
+				yld->notes_pending)
+
+#define YEALINK_TRACE_FLAGS(p) trace_yealink_flags(&yld->intf->dev, __func__, (p),\
+				yld_test(yld, YLD_SCAN_ACTIVE),\
+				yld_test(yld, YLD_UPDATE_ACTIVE),\
+				yld_test(yld, YLD_TIMER_EXPIRED),\
+				yld_test(yld, YLD_USB_PAUSE), yld->ctl_busy)
 
 
 struct yld_status {
@@ -171,12 +245,112 @@ static const struct lcd_segment_map {
 #include "yealink.h"
 };
 
+/* One entry of the control URB queue */
+struct yld_ctl_slot {
+	struct yealink_dev	*yld;
+	union yld_ctl_packet	*data;
+	dma_addr_t		dma;
+	struct urb		*urb;
+	int			notes_end;	/* last packet of ring notes */
+};
+
+/* Latency histogram, bucket n counts latencies in [2^(n-1), 2^n) us */
+struct yld_histogram {
+	atomic_long_t	count[YLD_HIST_BUCKETS];	/* any context */
+};
+
+/* Traffic and error counters, updated locklessly from any context */
+struct yld_counters {
+	atomic_long_t	tx_pkts[256];	/* packets sent per command code */
+	atomic_long_t	rx_pkts[256];	/* packets received per command code */
+	atomic_long_t	tx_bytes;
+	atomic_long_t	rx_bytes;
+	atomic_long_t	csum_err;	/* replies with invalid checksum */
+	atomic_long_t	bad_pkt;	/* STATE_BAD_PKT replies */
+	atomic_long_t	unexpected;	/* replies with unknown command code */
+	atomic_long_t	ctl_urb_err;	/* control URBs failed, not killed */
+	atomic_long_t	irq_urb_err;	/* irq URBs failed, not killed */
+	atomic_long_t	retries;	/* retries in submit_cmd_int_sync */
+	atomic_long_t	timer_late;	/* scan timer not serviced in time */
+	atomic_long_t	keys_missed;	/* keys fetched from the key buffer */
+	atomic_long_t	keys_lost;	/* keys overwritten in the key buffer */
+};
+
+struct yealink_dev;
+
+/* Bits in yealink_dev.state
+ *
+ * All flags live in one word and are only changed with atomic operations,
+ * there is no lock. Events of the URB callbacks and timers are recorded
+ * with one cmpxchg transition that also claims the update cycle, see
+ * run_cycle().
+ */
+enum yld_state_bits {
+	YLD_OPEN,		/* input device is open */
+	YLD_SHUTDOWN,		/* URBs are being killed */
+	YLD_SCAN_ACTIVE,	/* waiting for an irq reply */
+	YLD_UPDATE_ACTIVE,	/* control URB(s) in flight (G2: or gap) */
+	YLD_TIMER_ACTIVE,	/* timers are initialized, never cleared */
+	YLD_TIMER_EXPIRED,	/* key scan due (G1) */
+	YLD_USB_PAUSE,		/* stop the cycle, see quiesce_updates() */
+	YLD_CYCLE,		/* the update cycle is owned by a context */
+	YLD_CYCLE_AGAIN,	/* the owner has to run the cycle again */
+	YLD_UPDATE_REQ,		/* master status changed by userspace */
+	YLD_UPDATE_WAIT,	/* update_start is set, not in sync yet */
+	YLD_NOTES_LOST,		/* a ring note URB failed */
+	YLD_NOTES_DONE		/* the last ring note URB completed */
+};
+
+#define yld_test(yld, bit)	test_bit(bit, &(yld)->state)
+#define yld_set(yld, bit)	set_bit(bit, &(yld)->state)
+#define yld_clear(yld, bit)	clear_bit(bit, &(yld)->state)
+#define yld_assign(yld, bit, val)					\
+	do {								\
+		if (val)						\
+			yld_set(yld, bit);				\
+		else							\
+			yld_clear(yld, bit);				\
+	} while (0)
+
+/* URBs are in flight or the G2 command gap has not expired yet */
+#define yld_busy(yld)	(yld_test(yld, YLD_SCAN_ACTIVE) ||		\
+			 yld_test(yld, YLD_UPDATE_ACTIVE))
+
+/* Protocol engine, one for each generation of the USB protocol.
+ * See the description of the USB message and timer sequence below.
+ */
+struct yld_engine {
+	unsigned data_ofs;		/* offset of the payload in a packet */
+
+	/* checksum of a received packet, 0 if valid */
+	int (*verify)(union yld_ctl_packet *p);
+
+	/* start the traffic, called with the cycle stopped */
+	int (*start)(struct yealink_dev *yld, int with_key_scan);
+	/* submit what is due, called by the owner of the cycle */
+	int (*step)(struct yealink_dev *yld);
+	/* continue after an irq URB has been processed */
+	int (*irq_next)(struct yealink_dev *yld);
+	/* continue after a control URB has completed */
+	int (*ctl_next)(struct yealink_dev *yld, u8 cmd);
+};
+
 /* Structure to be initialized according to detected Yealink model */
 struct model_info {
 	char *name;
 	int (*keycode)(unsigned scancode);
 	enum yld_ctl_protocols protocol;
-	int (*fcheck)(size_t yld_status_offset);
+	const struct yld_engine *engine;
+	u64 features;			/* supported yld_status bytes */
+
+	/* model specific encoding of the commands and replies */
+	u16 poll_ms;			/* idle key scan delay (G1) */
+	u8  scan_size;			/* data size of a CMD_KEYPRESS request */
+	u8  scan_alt;			/* scan alternating with CMD_KEYPRESS */
+	u8  key_status;			/* CMD_KEYPRESS reply has ring & hook */
+	u8  led_pstn;			/* separate USB and PSTN LEDs */
+	u8  ring_cmd;			/* command to switch the ringtone */
+	u8  ring_on;			/* ringtone on value, 0: as written */
 };
 
 struct yealink_dev {
@@ -189,6 +363,13 @@ struct yealink_dev {
 
 	struct timer_list	timer;		/* timer for key/hook scans */
 	unsigned long		timer_delay;	/* model-specific timer delay */
+	unsigned long		poll_fast_delay; /* key/hook scan when active */
+	unsigned long		poll_hold;	/* duration of fast polling */
+	unsigned long		poll_fast_until; /* end of fast polling */
+	unsigned long		scan_count;	/* number of key/hook scans */
+
+	struct hrtimer		cmd_timer;	/* command pacing (G2 only) */
+	unsigned int		cmd_gap_us;	/* gap between commands */
 
 	/* irq input channel */
 	union yld_ctl_packet	*irq_data;
@@ -196,48 +377,83 @@ struct yealink_dev {
 	struct urb		*urb_irq;
 
 	/* control output channel */
-	union yld_ctl_packet	*ctl_data;
-	dma_addr_t		ctl_dma;
-	struct usb_ctrlrequest	*ctl_req;
+	struct usb_ctrlrequest	*ctl_req;	/* shared by all slots */
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,34)
 	dma_addr_t		ctl_req_dma;
 #endif
-	struct urb		*urb_ctl;
+	struct yld_ctl_slot	ctl[YEALINK_CTL_QUEUE_LEN];
+	unsigned long		ctl_busy;	/* submitted slots, atomic bitops */
+	unsigned		ctl_next;	/* next slot to be submitted */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
+	struct usb_anchor	ctl_anchor;	/* all submitted control URBs */
+#endif
 
-	/* flags */
-	unsigned		open:1;
-	unsigned		shutdown:1;
-	struct semaphore	usb_active_sem;
 	struct mutex 		pm_mutex;
+	struct rw_semaphore	sysfs_rwsem;	/* serializes sysfs accesses */
+	struct kref		kref;		/* sysfs users + usb binding */
 
-	unsigned	scan_active:1;
-	unsigned	update_active:1;
-	unsigned	timer_active:1;
-	unsigned	timer_expired:1;
-	unsigned	usb_pause:1;
-	spinlock_t	flags_lock;	/* protects above flags */
+	unsigned long	state;		/* YLD_* flags, atomic operations only */
 
 	char	phys[64];		/* physical device path */
 	char	uniq[27];		/* (semi-)unique device number */
 	char	name[20];		/* full device name */
 
+	struct seg7_conversion_map __rcu *seg7;	/* 7 segments char set */
 	u8 lcdMap[ARRAY_SIZE(lcdMap)];	/* state of LCD, LED ... */
+	DECLARE_BITMAP(lcd_stale, ARRAY_SIZE(lcdMap)); /* lcdMap[] unreliable */
+	u8	*fb;			/* raw LCD page, see /dev/yealinkN */
 	int	key_code;		/* last reported key	 */
 	u8	last_cmd;		/* last scan command: key/hook */
+	u8	key_seq;		/* last fetched key number (G1) */
+	u8	key_seq_valid;		/* key_seq is in sync with the phone */
 	u8	hookstate;		/* hookstate (B2K, B3G, P4K) */
 	u8	pstn_ring;		/* PSTN ring state (B2K, B3G) */
+	int	ring_state;		/* PSTN call state, see ring_sample() */
+	struct timer_list ring_timer;	/* PSTN ring debounce and end */
+	unsigned long ring_debounce;	/* ring time until call start */
+	unsigned long ring_end;		/* silence until call end */
+	int	pstn_auto;		/* switch to PSTN on incoming call */
 	int	stat_ix;		/* index in master/copy */
 	union {
 		struct yld_status s;
 		u8		  b[sizeof(struct yld_status)];
 	} master, copy;
+	DECLARE_BITMAP(dirty, sizeof(struct yld_status)); /* master != copy */
 	int	notes_ix;		/* index in ring_notes */
 	int	notes_len;		/* number of bytes in ring_notes[] */
-	u8	*ring_notes;		/* ptr. to array of ring notes */
+	u8	*ring_notes;		/* ring notes being sent */
+	u8	*notes_buf[2];		/* double buffered ring notes */
+	int	notes_buf_len[2];
+	int	notes_buf_slot[2];	/* ring_slot[] in notes_buf[] or -1 */
+	int	notes_cur;		/* notes_buf[] used by ring_notes */
+	int	notes_pending;		/* switch to the other buffer */
+	u32	notes_buf_hash[2];	/* jhash of notes_buf[] */
+	u32	notes_dev_hash;		/* hash of the notes held by the phone */
+	int	notes_dev_valid;	/* notes_dev_hash is valid */
+	int	notes_wait;		/* last packet submitted, not completed */
+	int	notes_err;		/* a packet of the sequence failed */
+	int	notes_again;		/* sequence requested while waiting */
+	u8	*ring_slot[YEALINK_RING_SLOTS];	/* cached raw ringtones */
+	size_t	ring_slot_len[YEALINK_RING_SLOTS];
+	int	ring_slot_loaded;	/* slot sent to the phone or -1 */
+
+	/* latency statistics, see debugfs interface */
+	ktime_t	scan_start;		/* last request expecting a reply */
+	ktime_t	key_start;		/* scan which detected a new key */
+	ktime_t	update_start;		/* first pending update from userspace */
+	struct yld_histogram lat_scan;	/* request -> reply (G1) */
+	struct yld_histogram lat_key;	/* scan -> input event (G1) */
+	struct yld_histogram lat_update; /* userspace -> last packet sent */
+	struct yld_counters cnt;
+	struct dentry *debugfs_dir;
+
+	/* update completion, see update_gen and flush in sysfs */
+	unsigned long		update_gen;	/* completed updates */
+	wait_queue_head_t	update_wq;	/* woken when in sync */
+	wait_queue_head_t	idle_wq;	/* woken when paused and idle */
+	struct work_struct	notify_work;	/* sysfs_notify update_gen */
 };
 
-static DECLARE_RWSEM(sysfs_rwsema);
-
 static char p1k_model[]  = "P1K";
 static char p4k_model[]  = "P4K";
 static char b2k_model[]  = "B2K";
@@ -247,10 +463,27 @@ static int map_p1k_to_key(unsigned);
 static int map_p4k_to_key(unsigned);
 static int map_b2k_to_key(unsigned);
 static int map_p1kh_to_key(unsigned);
-static int check_feature_p1k(size_t);
-static int check_feature_p4k(size_t);
-static int check_feature_b2k(size_t);
-static int check_feature_p1kh(size_t);
+static const struct yld_engine yld_engine_g1, yld_engine_g2;
+
+/* Supported features: one bit per yld_status byte the model handles */
+#define YLD_FEATURE(f)	(((1ULL << sizeof_field(struct yld_status, f)) - 1) \
+			 << offsetof(struct yld_status, f))
+
+#define YLD_FEATURES_P1K	(YLD_FEATURE(lcd) | YLD_FEATURE(led) |	\
+				 YLD_FEATURE(keynum) | YLD_FEATURE(ringvol) | \
+				 YLD_FEATURE(ringnote_mod) |		\
+				 YLD_FEATURE(ringtone))
+#define YLD_FEATURES_P1KH	(YLD_FEATURE(lcd) | YLD_FEATURE(led) |	\
+				 YLD_FEATURE(ringvol) |			\
+				 YLD_FEATURE(ringnote_mod) |		\
+				 YLD_FEATURE(ringtone))
+#define YLD_FEATURES_P4K	(YLD_FEATURE(lcd) | /*YLD_FEATURE(led) |*/ \
+				 YLD_FEATURE(backlight) |		\
+				 YLD_FEATURE(speaker) |			\
+				 YLD_FEATURE(keynum) | YLD_FEATURE(dialtone))
+#define YLD_FEATURES_B2K	(YLD_FEATURE(led) | YLD_FEATURE(pstn) |	\
+				 YLD_FEATURE(keynum) | YLD_FEATURE(ringtone) | \
+				 YLD_FEATURE(dialtone))
 
 /* model_info_idx_* have to match index in static model structure (below) */
 enum model_info_idx {
@@ -267,89 +500,234 @@ static const struct model_info model[] = {
 		.name     = p1k_model,
 		.keycode  = map_p1k_to_key,
 		.protocol = yld_ctl_protocol_g1,
-		.fcheck   = check_feature_p1k
+		.engine   = &yld_engine_g1,
+		.features = YLD_FEATURES_P1K,
+		.poll_ms  = YEALINK_POLLING_DELAY,
+		.scan_size = 1,
+		.ring_cmd = CMD_RINGTONE,
+		.ring_on  = 0x24
 	},{
 		.name     = p4k_model,
 		.keycode  = map_p4k_to_key,
 		.protocol = yld_ctl_protocol_g1,
-		.fcheck   = check_feature_p4k
+		.engine   = &yld_engine_g1,
+		.features = YLD_FEATURES_P4K,
+		.poll_ms  = YEALINK_POLLING_DELAY / 2,	/* double scan freq. */
+		.scan_size = 1,
+		.scan_alt = CMD_HOOKPRESS
 	},{
 		.name     = b2k_model,
 		.keycode  = map_b2k_to_key,
 		.protocol = yld_ctl_protocol_g1,
-		.fcheck   = check_feature_b2k
+		.engine   = &yld_engine_g1,
+		.features = YLD_FEATURES_B2K,
+		.poll_ms  = YEALINK_POLLING_DELAY / 2,	/* double scan freq. */
+		.scan_size = 1,
+		.scan_alt = CMD_HANDSET,
+		.led_pstn = 1,
+		.ring_cmd = CMD_B2K_RING
 	},{
 		.name     = b3g_model,
 		.keycode  = map_b2k_to_key,	/* same keymap as b2k */
 		.protocol = yld_ctl_protocol_g1,
-		.fcheck   = check_feature_b2k	/* for now same as b2k */
+		.engine   = &yld_engine_g1,
+		.features = YLD_FEATURES_B2K,	/* for now same as b2k */
+		.poll_ms  = YEALINK_POLLING_DELAY,
+		.scan_size = 3,			/* key, ring and hook */
+		.key_status = 1,
+		.led_pstn = 1,
+		.ring_cmd = CMD_B2K_RING
 	},{
 		.name     = p1kh_model,
 		.keycode  = map_p1kh_to_key,
 		.protocol = yld_ctl_protocol_g2,
-		.fcheck   = check_feature_p1kh
+		.engine   = &yld_engine_g2,
+		.features = YLD_FEATURES_P1KH,
+		.ring_cmd = CMD_RINGTONE,
+		.ring_on  = 0xff
 	}
 };
 
 /* forward declaration */
 //static void stop_traffic(struct yealink_dev *yld); @@@
+static void yld_cycle_lock(struct yealink_dev *yld);
+static void yld_cycle_unlock(struct yealink_dev *yld);
 
 /*******************************************************************************
  * Yealink lcd interface
  ******************************************************************************/
 
 /*
- * Register a default 7 segment character set
+ * Default 7 segment character set, each device starts with a copy of it
  */
-static SEG7_DEFAULT_MAP(map_seg7);
+static const SEG7_DEFAULT_MAP(map_seg7);
+
+/* Returns non-zero if the model handles the yld_status byte at offset */
+static inline int has_feature(const struct model_info *model, size_t offset)
+{
+	BUILD_BUG_ON(sizeof(struct yld_status) > 64);
+	return (model->features >> offset) & 1;
+}
+
+/* Modify a byte of the master status and mark it for the update cycle. */
+static inline void set_status_byte(struct yealink_dev *yld, int offset, u8 val)
+{
+	if (yld->master.b[offset] == val)
+		return;
+	yld->master.b[offset] = val;
+	smp_wmb();		/* master before dirty bit */
+	set_bit(offset, yld->dirty);
+}
 
- /* Display a char,
+ /* Display chars starting at element el,
   * char '\9' and '\n' are placeholders and do not overwrite the original text.
   * A space will always hide an icon.
+  *
+  * The chars are rendered into a scratch image of set and clear masks first,
+  * which is then merged into the master status with one write per touched
+  * byte. Elements already showing the requested char are skipped.
+  * The segments are looked up per char on purpose: precomputed per element
+  * tables would follow the per device char set, cost about 100 KB each and
+  * save well under a microsecond per line.
   */
-static int setChar(struct yealink_dev *yld, int el, int chr)
+struct lcd_image {
+	u8	set[sizeof(struct yld_status)];
+	u8	clr[sizeof(struct yld_status)];
+};
+
+static void render_char(struct seg7_conversion_map *map, int el,
+			int chr, struct lcd_image *img)
 {
 	int i, a, m, val;
 
-	if (unlikely(el >= ARRAY_SIZE(lcdMap)))
-		return -EINVAL;
-
-	if (chr == '\t' || chr == '\n')
-	    return 0;
-
-	yld->lcdMap[el] = chr;
-
 	if (lcdMap[el].type == '.') {
 		a = lcdMap[el].u.p.a;
 		m = lcdMap[el].u.p.m;
-		if (chr != ' ')
-			yld->master.b[a] |= m;
-		else
-			yld->master.b[a] &= ~m;
-		return 0;
+		if (chr != ' ') {
+			img->set[a] |= m;
+			img->clr[a] &= ~m;
+		} else {
+			img->clr[a] |= m;
+			img->set[a] &= ~m;
+		}
+		return;
 	}
 
-	val = map_to_seg7(&map_seg7, chr);
+	val = map_to_seg7(map, chr);
 	for (i = 0; i < ARRAY_SIZE(lcdMap[0].u.s); i++) {
 		m = lcdMap[el].u.s[i].m;
 
 		if (m == 0)
 			continue;
 
+		/* segments sharing a status bit: the last one decides */
 		a = lcdMap[el].u.s[i].a;
-		if (val & 1)
-			yld->master.b[a] |= m;
-		else
-			yld->master.b[a] &= ~m;
+		if (val & 1) {
+			img->set[a] |= m;
+			img->clr[a] &= ~m;
+		} else {
+			img->clr[a] |= m;
+			img->set[a] &= ~m;
+		}
 		val = val >> 1;
 	}
+}
+
+static int setChars(struct yealink_dev *yld, int el, const char *buf,
+		    size_t len)
+{
+	struct lcd_image img;
+	struct seg7_conversion_map *map;
+	int i, a, chr;
+
+	if (unlikely(el >= ARRAY_SIZE(lcdMap)))
+		return -EINVAL;
+	if (len > ARRAY_SIZE(lcdMap) - el)
+		len = ARRAY_SIZE(lcdMap) - el;
+
+	memset(&img, 0, sizeof(img));
+	rcu_read_lock();
+	map = rcu_dereference(yld->seg7);
+	for (i = 0; i < len; i++, el++) {
+		chr = buf[i];
+		if (chr == '\t' || chr == '\n')
+			continue;
+		if (yld->lcdMap[el] == chr && !test_bit(el, yld->lcd_stale))
+			continue;
+		clear_bit(el, yld->lcd_stale);
+		yld->lcdMap[el] = chr;
+		render_char(map, el, chr, &img);
+	}
+	rcu_read_unlock();
+
+	for (a = 0; a < sizeof(img.set); a++) {
+		if (img.set[a] | img.clr[a])
+			set_status_byte(yld, a,
+				(yld->master.b[a] & ~img.clr[a]) | img.set[a]);
+	}
 	return 0;
-};
+}
+
+static int setChar(struct yealink_dev *yld, int el, int chr)
+{
+	char c = chr;
+
+	return setChars(yld, el, &c, 1);
+}
 
 /*******************************************************************************
  * Yealink ringtone interface
  ******************************************************************************/
 
+/* Start using pending ring notes from set_ringnotes().
+ * Must be called by the owner of the update cycle, with no ring note
+ * sequence in progress.
+ */
+static void switch_ring_notes(struct yealink_dev *yld)
+{
+	if (!yld->notes_pending)
+		return;
+	yld->notes_cur = !yld->notes_cur;
+	yld->notes_pending = 0;
+	yld->ring_notes = yld->notes_buf[yld->notes_cur];
+	yld->notes_len = yld->notes_buf_len[yld->notes_cur];
+	YEALINK_TRACE_NOTES("switch", yld->notes_cur);
+}
+
+/* Account for completed ring note URBs. A failed packet invalidates the
+ * notes held by the phone. The sequence only becomes valid once its last
+ * packet completed and none of its packets failed, otherwise it is sent
+ * again. Must be called by the owner of the update cycle.
+ */
+static void check_notes_sent(struct yealink_dev *yld)
+{
+	int ix = offsetof(struct yld_status, ringnote_mod);
+
+	if (test_and_clear_bit(YLD_NOTES_LOST, &yld->state)) {
+		yld->notes_err = 1;
+		yld->notes_dev_valid = 0;
+		yld->ring_slot_loaded = -1;
+	}
+	if (!test_and_clear_bit(YLD_NOTES_DONE, &yld->state))
+		return;
+	yld->notes_wait = 0;
+	if (!yld->notes_err) {
+		yld->notes_dev_hash = yld->notes_buf_hash[yld->notes_cur];
+		yld->notes_dev_valid = 1;
+		yld->ring_slot_loaded = yld->notes_buf_slot[yld->notes_cur];
+		YEALINK_TRACE_NOTES("sent", yld->notes_cur);
+	} else {
+		YEALINK_TRACE_NOTES("failed", yld->notes_cur);
+	}
+	if (yld->notes_err || yld->notes_again || yld->notes_pending) {
+		/* resend, or send the notes stored meanwhile */
+		yld->notes_err = 0;
+		yld->notes_again = 0;
+		yld->copy.b[ix] = ~yld->master.b[ix];
+		set_bit(ix, yld->dirty);
+	}
+}
+
 static u8 default_ringtone_g1[] = {
 	0xEF,			/* volume [0-255] */
 	0xFB, 0x1E, 0x00, 0x0C,	/* 1250 [hz], 12/100 [s] */
@@ -371,16 +749,25 @@ static u8 default_ringtone_g2[] = {
 	0x00, 0x00	/* end of sequence */
 };
 
-static int set_ringnotes(struct yealink_dev *yld, u8 *buf, size_t size)
+/* Store new ring notes in the buffer not used by the update cycle.
+ *
+ * The update cycle switches to it when it starts sending the ring notes
+ * the next time, so a sequence being sent is never modified and traffic
+ * does not need to be stopped. slot is the ringtone slot the notes come
+ * from or -1, it becomes ring_slot_loaded once they are sent completely.
+ */
+static int set_ringnotes(struct yealink_dev *yld, u8 *buf, size_t size,
+			 int slot)
 {
 	int	eos;		/* end of sequence */
 	int	i;
+	u8	*notes;
 
 	if (unlikely((buf == NULL) || (size == 0)))
 		return 0;
 
 	/* adjust the volume */
-	yld->master.s.ringvol = buf[0];
+	set_status_byte(yld, offsetof(struct yld_status, ringvol), buf[0]);
 	if (size == 1)		/* do not touch the ring notes */
 		return 0;
 
@@ -389,19 +776,16 @@ static int set_ringnotes(struct yealink_dev *yld, u8 *buf, size_t size)
 
 	buf++;
 	size--;
-	if (yld->ring_notes != NULL) {
-		kfree(yld->ring_notes);
-		yld->ring_notes = NULL;
-	}
-	yld->ring_notes = kmalloc(size + 2, GFP_KERNEL);
-	if (!yld->ring_notes)
-		return -ENOMEM;
+	if (size > YEALINK_RING_NOTES_MAX - 2)
+		size = YEALINK_RING_NOTES_MAX - 2;
 
+	yld_cycle_lock(yld);
+	notes = yld->notes_buf[!yld->notes_cur];
 	i = 0;
 	eos = 0;
 	while (i < (size - 1)) {
-		yld->ring_notes[i] = buf[i];
-		yld->ring_notes[i+1] = buf[i+1];
+		notes[i] = buf[i];
+		notes[i+1] = buf[i+1];
 		eos = (buf[i] == 0) && (buf[i+1] == 0);
 		i += 2;
 		if (eos)
@@ -409,11 +793,15 @@ static int set_ringnotes(struct yealink_dev *yld, u8 *buf, size_t size)
 	}
 	if (!eos) {
 		/* create the end-of-sequence marker */
-		yld->ring_notes[i++] = 0;
-		yld->ring_notes[i++] = 0;
+		notes[i++] = 0;
+		notes[i++] = 0;
 	}
-	yld->notes_len = i;
-	yld->notes_ix = 0;
+	yld->notes_buf_len[!yld->notes_cur] = i;
+	yld->notes_buf_hash[!yld->notes_cur] = jhash(notes, i, 0);
+	yld->notes_buf_slot[!yld->notes_cur] = slot;
+	yld->notes_pending = 1;
+	YEALINK_TRACE_NOTES("stored", !yld->notes_cur);
+	yld_cycle_unlock(yld);
 	return 0;
 }
 
@@ -573,7 +961,8 @@ static int map_b2k_to_key(unsigned scancode)
 	};
 	static const int map2[] = {		/* code	key	*/
 		KEY_PHONE,			/* off-hook	*/
-		KEY_P				/* PSTN ring	*/
+		KEY_P,				/* PSTN ring	*/
+		YEALINK_KEY_PSTN_CALL		/* PSTN call	*/
 	};
 
 	if (scancode < ARRAY_SIZE(map)) {
@@ -655,54 +1044,6 @@ static void report_key(struct yealink_dev *yld, int key)
 	input_sync(idev);
 }
 
-/*******************************************************************************
- * Yealink model features
- ******************************************************************************/
-
-static int check_feature_p1k(size_t offset)
-{
-	return  (offset >= offsetof(struct yld_status, lcd) &&
-		 offset < offsetof(struct yld_status, lcd) +
-			  sizeof_field(struct yld_status, lcd)) ||
-		offset == offsetof(struct yld_status, led) ||
-		offset == offsetof(struct yld_status, keynum) ||
-		offset == offsetof(struct yld_status, ringvol) ||
-		offset == offsetof(struct yld_status, ringnote_mod) ||
-		offset == offsetof(struct yld_status, ringtone);
-}
-
-static int check_feature_p1kh(size_t offset)
-{
-	return  (offset >= offsetof(struct yld_status, lcd) &&
-		 offset < offsetof(struct yld_status, lcd) +
-			  sizeof_field(struct yld_status, lcd)) ||
-		offset == offsetof(struct yld_status, led) ||
-		offset == offsetof(struct yld_status, ringvol) ||
-		offset == offsetof(struct yld_status, ringnote_mod) ||
-		offset == offsetof(struct yld_status, ringtone);
-}
-
-static int check_feature_p4k(size_t offset)
-{
-	return  (offset >= offsetof(struct yld_status, lcd) &&
-		 offset < offsetof(struct yld_status, lcd) +
-			  sizeof_field(struct yld_status, lcd)) ||
-		/*offset == offsetof(struct yld_status, led) ||*/
-		offset == offsetof(struct yld_status, backlight) ||
-		offset == offsetof(struct yld_status, speaker) ||
-		offset == offsetof(struct yld_status, keynum) ||
-		offset == offsetof(struct yld_status, dialtone);
-}
-
-static int check_feature_b2k(size_t offset)
-{
-	return  offset == offsetof(struct yld_status, led) ||
-		offset == offsetof(struct yld_status, pstn) ||
-		offset == offsetof(struct yld_status, keynum) ||
-		offset == offsetof(struct yld_status, ringtone) ||
-		offset == offsetof(struct yld_status, dialtone);
-}
-
 /*******************************************************************************
  * Yealink usb communication interface
  ******************************************************************************/
@@ -720,6 +1061,12 @@ static int check_feature_b2k(size_t offset)
    
    This loop is executed continuously scanning the keypad/hook in regular
    intervals. No control message may be submitted from outside this loop.
+
+   Update messages (LCD, LED, ...) do not expect a reply, so up to
+   YEALINK_CTL_QUEUE_LEN of them are queued back-to-back on the control
+   endpoint. The queue is refilled from the callback of each completed
+   message. A key/hook scan is only submitted once the queue has drained,
+   and nothing else is queued behind a message expecting an irq reply.
    
    P1KH:
    -----
@@ -730,19 +1077,67 @@ static int check_feature_b2k(size_t offset)
    Control Endpoint:
      1. submit control message
      2. callback control message
-     3. start timer to wait until YEALINK_COMMAND_DELAY_G2 has expired since 2
+     3. start hrtimer to wait until cmd_gap_us (YEALINK_COMMAND_DELAY_G2 by
+        default) has expired since 2
         Note: For INIT/VERSION the delay is multiplied by 4!
      4. timer expires, goto step 1
    
    The loop of the control endpoint is initiated when the driver is loaded or
-   by the sysfs interface functions. It is important to decrement a protecting
-   semaphore before submitting the first control message.
-   Once all changes are updated, the semaphore is released (in interrupt
-   context) and the loop terminates.
+   by the sysfs interface functions. Once all changes are updated the loop
+   terminates.
+   YLD_UPDATE_ACTIVE stays set while the hrtimer is pending, so the gap is
+   always kept.
+
+   Each sequence is implemented by its own struct yld_engine (yld_engine_g1,
+   yld_engine_g2); the callbacks only dispatch to the engine of the model.
+   Every completed URB, timer tick and poke from userspace runs the step of
+   the engine through run_cycle(). No lock is taken: one context at a time
+   owns the cycle (YLD_CYCLE), the others leave their event to it.
+
+   Traffic states (all models):
+   ----------------------------
+   running	YLD_SCAN_ACTIVE or YLD_UPDATE_ACTIVE is set, URBs are in flight
+   stopped	neither is set, the next poke or timer restarts the cycle
+   owned	YLD_CYCLE is set, a context is running the step, quiesce_updates()
+		waits for it as well
+   paused	YLD_USB_PAUSE is set, the cycle stops after the current
+		transfer and wakes up idle_wq (see quiesce_updates()), then
+		only start_traffic() restarts it
  */
 
 /* ... @@ */
 
+static void hist_add(struct yld_histogram *h, ktime_t start, ktime_t end)
+{
+	s64 us = ktime_us_delta(end, start);
+	int n;
+
+	n = (us > 0) ? fls64(us) : 0;
+	if (n >= YLD_HIST_BUCKETS)
+		n = YLD_HIST_BUCKETS - 1;
+	atomic_long_inc(&h->count[n]);
+}
+
+static void hist_reset(struct yld_histogram *h)
+{
+	int i;
+
+	for (i = 0; i < YLD_HIST_BUCKETS; i++)
+		atomic_long_set(&h->count[i], 0);
+}
+
+static inline void count_tx(struct yealink_dev *yld, u8 cmd, int len)
+{
+	atomic_long_inc(&yld->cnt.tx_pkts[cmd]);
+	atomic_long_add(len, &yld->cnt.tx_bytes);
+}
+
+static inline void count_rx(struct yealink_dev *yld, u8 cmd, int len)
+{
+	atomic_long_inc(&yld->cnt.rx_pkts[cmd]);
+	atomic_long_add(len, &yld->cnt.rx_bytes);
+}
+
 static void pkt_update_checksum(union yld_ctl_packet *p, int len)
 {
 	u8 *bp = (u8 *) p;
@@ -772,9 +1167,10 @@ static int submit_cmd_sync(struct yealink_dev *yld,
 		0x200, 3,
 		p, len,
 		USB_CTRL_SET_TIMEOUT);
-	if (ret == len)
+	if (ret == len) {
+		count_tx(yld, p->cmd, len);
 		ret = 0;
-	else if (ret >= 0)
+	} else if (ret >= 0)
 		ret = -ENODATA;
 	if (ret != 0)
 		dev_err(&yld->intf->dev, "%s - usb_submit_urb failed %d (cmd 0x%02x)",
@@ -792,12 +1188,14 @@ static int submit_int_sync(struct yealink_dev *yld,
 		p, len, &act_len,
 		YEALINK_USB_INT_TIMEOUT);
 	if (ret == 0) {
+		count_rx(yld, p->cmd, act_len);
 		if (len != act_len) {
 			dev_err(&yld->intf->dev, "%s - short packet %d/%d", __FUNCTION__,
 				act_len, len);
 			ret = -ENODATA;
 		}
 		if (pkt_verify_checksum(p, len) != 0) {
+			atomic_long_inc(&yld->cnt.csum_err);
 			dev_err(&yld->intf->dev, "%s - invalid checksum", __FUNCTION__);
 			ret = -EBADMSG;
 		}
@@ -819,8 +1217,10 @@ static int submit_cmd_int_sync(struct yealink_dev *yld,
 			ret = submit_int_sync(yld, ip, ilen);
 		if ((ret == 0) && (ip->cmd != cp->cmd))
 			ret = -ENOMSG;
-		if ((ret != 0) && (repeat > 0))
+		if ((ret != 0) && (repeat > 0)) {
+			atomic_long_inc(&yld->cnt.retries);
 			msleep_interruptible(4 * YEALINK_COMMAND_DELAY_G2);
+		}
 	}
 	if (ret == -ENOMSG)
 		dev_err(&yld->intf->dev, "%s - command 0x%02x, reply 0x%02x", __FUNCTION__,
@@ -828,69 +1228,202 @@ static int submit_cmd_int_sync(struct yealink_dev *yld,
 	return ret;
 }
 
-/* g1 only */
+/* Returns non-zero if the device answers the command on the irq endpoint */
+static inline int cmd_expects_reply(u8 cmd)
+{
+	return  cmd == CMD_KEYPRESS || cmd == CMD_SCANCODE ||
+		cmd == CMD_HOOKPRESS || cmd == CMD_HANDSET;
+}
+
+/* Returns the next control queue slot if it is available.
+ * Must be called by the owner of the update cycle.
+ */
+static struct yld_ctl_slot *get_ctl_slot(struct yealink_dev *yld)
+{
+	if (test_bit(yld->ctl_next, &yld->ctl_busy))
+		return NULL;
+	return &yld->ctl[yld->ctl_next];
+}
+
+/* Submits a prepared control queue slot.
+ * Must be called by the owner of the update cycle, so packets are submitted
+ * in exactly the order they were prepared in. The slot is marked busy
+ * before, its callback may run on another CPU right away.
+ */
+static int submit_ctl_slot(struct yealink_dev *yld, struct yld_ctl_slot *slot,
+			   int mem_flags)
+{
+	int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
+	usb_anchor_urb(slot->urb, &yld->ctl_anchor);
+#endif
+	set_bit(slot - yld->ctl, &yld->ctl_busy);
+	ret = usb_submit_urb(slot->urb, mem_flags);
+	if (yld->model->protocol == yld_ctl_protocol_g1)
+		trace_yealink_ctl_submit(&yld->intf->dev, (u8 *) slot->data,
+					 USB_PKT_LEN_G1,
+					 be16_to_cpu(slot->data->g1.offset),
+					 slot->data->g1.size, ret);
+	else
+		trace_yealink_ctl_submit(&yld->intf->dev, (u8 *) slot->data,
+					 USB_PKT_LEN_G2, 0, 0, ret);
+	if (ret != 0) {
+		clear_bit(slot - yld->ctl, &yld->ctl_busy);
+		if (slot->data->cmd == CMD_RING_NOTE) {
+			/* no completion follows, send the notes again */
+			set_bit(YLD_NOTES_LOST, &yld->state);
+			if (slot->notes_end)
+				set_bit(YLD_NOTES_DONE, &yld->state);
+			check_notes_sent(yld);
+		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
+		usb_unanchor_urb(slot->urb);
+#endif
+		dev_err(&yld->intf->dev, "%s - usb_submit_urb failed %d", __FUNCTION__, ret);
+		return ret;
+	}
+	if (++yld->ctl_next >= YEALINK_CTL_QUEUE_LEN)
+		yld->ctl_next = 0;
+	return 0;
+}
+
+static void kill_ctl_urbs(struct yealink_dev *yld)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
+	usb_kill_anchored_urbs(&yld->ctl_anchor);
+#else
+	int i;
+
+	for (i = 0; i < YEALINK_CTL_QUEUE_LEN; i++)
+		usb_kill_urb(yld->ctl[i].urb);
+#endif
+}
+
+/* g1 only, must be called by the owner of the update cycle.
+ * Sets YLD_SCAN_ACTIVE if the request was submitted.
+ */
 static int submit_scan_request(struct yealink_dev *yld, int mem_flags)
 {
-	union yld_ctl_packet *ctl_data = yld->ctl_data;
+	struct yld_ctl_slot *slot;
+	union yld_ctl_packet *ctl_data;
 	int ret;
 
 	BUG_ON(yld->model->protocol != yld_ctl_protocol_g1);
 
+	slot = get_ctl_slot(yld);
+	if (unlikely(slot == NULL))
+		return -EBUSY;
+	ctl_data = slot->data;
+
 	memset(ctl_data, 0, sizeof(*ctl_data));
-	ctl_data->g1.size = (yld->model->name == b3g_model) ? 3 : 1;
+	ctl_data->g1.size = yld->model->scan_size;
 	ctl_data->g1.sum = -ctl_data->g1.size;
 	ctl_data->cmd  = CMD_KEYPRESS;
-	if (yld->last_cmd == CMD_KEYPRESS) {
-		if (yld->model->name == p4k_model)
-			ctl_data->cmd  = CMD_HOOKPRESS;
-		else if (yld->model->name == b2k_model)
-			ctl_data->cmd  = CMD_HANDSET;
-	}
+	if (yld->last_cmd == CMD_KEYPRESS && yld->model->scan_alt)
+		ctl_data->cmd  = yld->model->scan_alt;
 	ctl_data->g1.sum -= ctl_data->cmd;
 	yld->last_cmd = ctl_data->cmd;
+	yld->scan_count++;
+	yld->scan_start = ktime_get();
 
-	ret = usb_submit_urb(yld->urb_ctl, mem_flags);
+	/* the reply may arrive before submit_ctl_slot() returns */
+	yld_set(yld, YLD_SCAN_ACTIVE);
+	ret = submit_ctl_slot(yld, slot, mem_flags);
 	if (ret != 0)
-		dev_err(&yld->intf->dev, "%s - usb_submit_urb failed %d", __FUNCTION__, ret);
+		yld_clear(yld, YLD_SCAN_ACTIVE);
 	return ret;
 }
 
+/* Returns the offset of the next modified byte in the master status,
+ * starting at ix and wrapping around, or -1 if there is none.
+ */
+static int find_next_dirty(struct yealink_dev *yld, int ix)
+{
+	int n;
+
+	n = find_next_bit(yld->dirty, sizeof(struct yld_status), ix);
+	if (n >= sizeof(struct yld_status)) {
+		n = find_first_bit(yld->dirty, ix);
+		if (n >= ix)
+			return -1;
+	}
+	return n;
+}
+
+/* Plan the next CMD_LCD packet for the modified LCD byte at ix.
+ *
+ * Covering the modified LCD bytes from left to right, with each window
+ * starting at the leftmost byte still modified, needs the least number of
+ * packets for a given window size. Unmodified bytes in between are simply
+ * bridged, and the window is trimmed after the last modified byte.
+ * Returns the number of bytes to send starting at *start.
+ */
+static int plan_lcd_packet(struct yealink_dev *yld, int ix, int window,
+			   int *start)
+{
+	const int end = offsetof(struct yld_status, lcd) +
+			sizeof_field(struct yld_status, lcd);
+	int i, first, last;
+
+	/* copy.b[ix] was already synced by the caller */
+	first = ix;
+	for (i = offsetof(struct yld_status, lcd); i < ix; i++) {
+		if (yld->master.b[i] != yld->copy.b[i]) {
+			first = i;
+			break;
+		}
+	}
+	last = first;
+	for (i = first; i < first + window && i < end; i++) {
+		if (i == ix || yld->master.b[i] != yld->copy.b[i])
+			last = i;
+	}
+	*start = first;
+	return last - first + 1;
+}
+
 /* keep stat_master & stat_copy in sync.
+ * Only bytes marked in the dirty bitmap are compared.
  * returns  = 0 if no packet was prepared (= no releavant differences found)
- *         /= 0 if a command was assembled in yld->ctl_data
+ *         /= 0 if a command was assembled in ctl_data
  */
-static int prepare_update_cmd(struct yealink_dev *yld)
+static int prepare_update_cmd(struct yealink_dev *yld,
+			      struct yld_ctl_slot *slot)
 {
-	union yld_ctl_packet *ctl_data;
+	union yld_ctl_packet *ctl_data = slot->data;
 	enum yld_ctl_protocols proto;
 	const struct model_info *model;
 	u8 val;
 	u8 *data;
 	u8 offset;
-	int i, ix, len;
+	int i, ix, next, start, len;
 
 	model = yld->model;
 	proto = model->protocol;
 	ix = yld->stat_ix;
-	ctl_data = yld->ctl_data;
 	data = (proto == yld_ctl_protocol_g1) ?
 		ctl_data->g1.data : ctl_data->g2.data;
 
 	ctl_data->cmd = 0;		/* no packet prepared so far */
+	slot->notes_end = 0;
 
 	/* big loop: process any mismatches between master & copy */
 	do {
-		/* tight loop: find update candidates copy != master */
-		do {
+		/* tight loop: find update candidates among the modified bytes */
+		while ((next = find_next_dirty(yld, ix)) >= 0) {
+			ix = next;
+			/* fully ordered, master is read after clearing the bit */
+			test_and_clear_bit(ix, yld->dirty);
 			val = yld->master.b[ix];
-			if (unlikely(val != yld->copy.b[ix])) {
+			if (likely(val != yld->copy.b[ix])) {
 				yld->copy.b[ix] = val;
-				if (model->fcheck(ix))
+				if (has_feature(model, ix))
 					goto handle_difference;
 			}
 			if (++ix >= sizeof(yld->master))
 				ix = 0;
-		} while (ix != yld->stat_ix);
+		}
 
 		break;
 
@@ -904,8 +1437,7 @@ handle_difference:
 		switch(ix) {
 		case offsetof(struct yld_status, led):
 			ctl_data->cmd	= CMD_LED;
-			if (model->name == b2k_model ||
-			    model->name == b3g_model) {
+			if (model->led_pstn) {
 				int pstn = yld->master.s.pstn;
 				data[0] = (val && !pstn) ? 0xff : 0x00;
 				data[1] = (pstn || yld->pstn_ring) ? 0xff : 0x00;
@@ -921,6 +1453,17 @@ handle_difference:
 			break;
 		case offsetof(struct yld_status, ringnote_mod):
 			/* Models P1K, P1KH */
+			if (yld->notes_ix == 0) {
+				if (yld->notes_wait) {
+					/* see check_notes_sent() */
+					yld->notes_again = 1;
+					break;
+				}
+				/* a new sequence overwrites the phone's notes */
+				switch_ring_notes(yld);
+				yld->notes_dev_valid = 0;
+				yld->ring_slot_loaded = -1;
+			}
 			if (!yld->ring_notes ||
 			    yld->notes_ix >= yld->notes_len)
 				break;
@@ -938,9 +1481,15 @@ handle_difference:
 			yld->notes_ix += len;
 			if (yld->notes_ix < yld->notes_len) {
 				yld->copy.b[ix] = ~val;	/* not done yet */
+				set_bit(ix, yld->dirty);
 				ix--;
-			} else
+			} else {
+				/* valid once the last packet completed,
+				 * see check_notes_sent() */
 				yld->notes_ix = 0;	/* reset for next time */
+				yld->notes_wait = 1;
+				slot->notes_end = 1;
+			}
 			break;
 		case offsetof(struct yld_status, dialtone):
 			/* Models B2K, B3G, P4K */
@@ -948,18 +1497,12 @@ handle_difference:
 			data[0] = val;
 			break;
 		case offsetof(struct yld_status, ringtone):
-			if (model->name == p1k_model ||
-			    model->name == p1kh_model) {
-				ctl_data->cmd	= CMD_RINGTONE;
-				if (model->name == p1k_model)
-					data[0] = (val) ? 0x24 : 0x00;
-				else
-					data[0] = (val) ? 0xff : 0x00;
-			} else {
-				/* B2K, B3G */
-				ctl_data->cmd	= CMD_B2K_RING;
+			/* Models P1K(H), B2K, B3G */
+			ctl_data->cmd	= model->ring_cmd;
+			if (model->ring_on)
+				data[0] = (val) ? model->ring_on : 0x00;
+			else
 				data[0] = val;
-			}
 			break;
 		case offsetof(struct yld_status, backlight):
 			/* Models P4K */
@@ -977,28 +1520,55 @@ handle_difference:
 			data[0] = val;
 			/* force update of LED */
 			yld->copy.s.led = ~yld->master.s.led;
+			set_bit(offsetof(struct yld_status, led), yld->dirty);
 			break;
 		case offsetof(struct yld_status, keynum):
-			/* explicit query for key code only required for G1 phones */
-			val--;
-			val &= 0x1f;
+			/* explicit query for key code only required for G1 phones.
+			 * The phone counts key changes in keynum and keeps the
+			 * last YEALINK_KEY_BUF scancodes, key number n at index
+			 * (n - 1) & 0x1f. Fetch all of them in order, so keys
+			 * changing twice within one poll are not lost.
+			 */
+			if (!yld->key_seq_valid) {
+				yld->key_seq = val - 1;
+				yld->key_seq_valid = 1;
+			}
+			i = (u8)(val - yld->key_seq);
+			if (i > YEALINK_KEY_BUF) {
+				atomic_long_add(i - YEALINK_KEY_BUF,
+						&yld->cnt.keys_lost);
+				yld->key_seq = val - YEALINK_KEY_BUF;
+			}
 			ctl_data->cmd		= CMD_SCANCODE;
 			ctl_data->g1.size	= 1;
-			ctl_data->g1.offset	= cpu_to_be16(val);
+			ctl_data->g1.offset	= cpu_to_be16(yld->key_seq & 0x1f);
+			yld->key_seq++;
+			if (yld->key_seq != val) {
+				atomic_long_inc(&yld->cnt.keys_missed);
+				yld->copy.b[ix] = ~val;	/* not done yet */
+				set_bit(ix, yld->dirty);
+				ix--;
+			}
 			break;
 		default:
 			/* Models P1K(H), P4K */
+			len = plan_lcd_packet(yld, ix,
+				(proto == yld_ctl_protocol_g1) ?
+					sizeof(ctl_data->g1.data) :
+					sizeof(ctl_data->g2.data) - 2,
+				&start);
+			if (ix >= start + len) {
+				/* not covered by this packet, send it later */
+				yld->copy.b[ix] = ~val;
+				set_bit(ix, yld->dirty);
+			}
+			ix = start;
 		    	offset = ix - offsetof(struct yld_status, lcd);
-			len = sizeof(yld->master.s.lcd) - offset;
 
 			if (proto == yld_ctl_protocol_g1) {
-				if (len > sizeof(ctl_data->g1.data))
-					len = sizeof(ctl_data->g1.data);
 				ctl_data->g1.offset = cpu_to_be16(offset);
 				ctl_data->g1.size   = len;
 			} else {
-				if (len > sizeof(ctl_data->g2.data) - 2)
-					len = sizeof(ctl_data->g2.data) - 2;
 				data[0]	= len;		/* size */
 				data[1]	= offset;	/* offset */
 				data += 2;		/* data starts here */
@@ -1008,6 +1578,7 @@ handle_difference:
 			 * in a singe request */
 			ctl_data->cmd	= CMD_LCD;
 			for (i = 0; i < len; i++) {
+				test_and_clear_bit(ix, yld->dirty);
 				val = yld->master.b[ix];
 				yld->copy.b[ix]	= val;
 				data[i]		= val;
@@ -1018,222 +1589,434 @@ handle_difference:
 		}
 		if (++ix >= sizeof(yld->master))
 			ix = 0;
-	} while ((ctl_data->cmd == 0) && (ix != yld->stat_ix));
+	} while (ctl_data->cmd == 0);
 
 	yld->stat_ix = ix;
 
 	return (ctl_data->cmd != 0);
 }
 
-/* Reactivate the update cycle if currently not active.
- *
- * This function is usually called by userspace after modifying the
- * master status. If the update cycle is currently not active then the
- * next update command is determined and sent to the device.
+/* Returns non-zero if the update at stat_ix must not be interrupted:
+ * writing ringtone notes (G1 & G2) and fetching a scancode (G1 only).
  */
-static int poke_update_from_userspace(struct yealink_dev *yld)
+static inline int update_in_progress(struct yealink_dev *yld)
 {
-	enum yld_ctl_protocols proto;
-	int timer_expired, idle;
-	int do_update = 0;
-	int do_scan = 0;
-	int ret = 0;
-	unsigned long spin_flags;
-
-	//BUG_ON(yld->usb_pause);	@@@
-	if (yld->usb_pause)
-		return 0;
-
-	proto = yld->model->protocol;
-
-	YEALINK_DBG_FLAGS("U:");
-	spin_lock_irqsave(&yld->flags_lock, spin_flags);
-	timer_expired = yld->timer_expired;
-	idle = !yld->update_active && !yld->scan_active;
-
-	if (proto == yld_ctl_protocol_g1) {
-		do_update = idle && !timer_expired;
-		do_scan = idle && timer_expired;
-	} else {	/* yld_ctl_protocol_g2 */
-		do_update = idle && timer_expired;
-	}
-
-	if (do_update) {
-		/* find update candidates: copy != master */
-		do_update = prepare_update_cmd(yld);
-	}
+	int ix = yld->stat_ix;
 
-	yld->update_active = yld->update_active || do_update;
-	if (proto == yld_ctl_protocol_g1) {
-		yld->scan_active = yld->scan_active || do_scan;
-		yld->timer_expired = timer_expired && !do_scan;
-	} else {	/* yld_ctl_protocol_g2 */
-		yld->timer_expired = timer_expired && !do_update;
-	}
-	spin_unlock_irqrestore(&yld->flags_lock, spin_flags);
-	YEALINK_DBG_FLAGS("  ");
-
-	if (do_update) {
-		pkt_update_checksum(yld->ctl_data, USB_PKT_LEN(proto));
-		if (likely(!yld->shutdown))
-			ret = usb_submit_urb(yld->urb_ctl, GFP_KERNEL);
-	} else if (do_scan) {
-		if (likely(!yld->shutdown))
-			ret = submit_scan_request(yld, GFP_KERNEL);
-	} else {
-		dev_dbg(&yld->intf->dev, "   no update/scan required");
-	}
-	return ret;
+	return  ((ix == offsetof(struct yld_status, ringnote_mod)) &&
+		 (yld->notes_ix != 0)) ||
+		((ix == offsetof(struct yld_status, keynum)) &&
+		 (yld->master.b[ix] != yld->copy.b[ix]));
 }
 
-/* Try to submit an update command to the device (G1 devices).
- * 
- * This function is invoked by callback functions to possibly submit an
- * update command to the device:
- * - by urb_ctl_callback if the next update can be performed
- * - by urb_irq_callback (unconditionally)
+/* Fill the control queue with update commands (G1 devices).
  *
- * This function may be called from hard-irq context.
+ * Commands are queued until either the queue is full, a key scan is due,
+ * or a command expecting a reply on the irq endpoint was queued. Nothing
+ * is queued while a reply is pending.
+ * Must be called by the owner of the update cycle.
  */
-static int perform_single_update_g1(struct yealink_dev *yld)
+static int queue_update_cmds_g1(struct yealink_dev *yld, int mem_flags)
 {
-	int dont_break, pause;
-	int timer_expired;
-	int do_update, do_scan;
+	struct yld_ctl_slot *slot;
+	int reply;
 	int ret = 0;
-	int ix;
 
-	/* writing ringtone notes must not be interrupted (G1 & G2) */
-	/* same for key scan (G1 only) */
-	ix = yld->stat_ix;
-	dont_break = ((ix == offsetof(struct yld_status, ringnote_mod)) &&
-		      (yld->notes_ix != 0)) ||
-		     ((ix == offsetof(struct yld_status, keynum)) &&
-		      (yld->master.b[ix] != yld->copy.b[ix]));
-
-	YEALINK_DBG_FLAGS("S:");
-	spin_lock(&yld->flags_lock);
-	pause = yld->usb_pause;
-	timer_expired = yld->timer_expired;
-	do_update = (!timer_expired && !pause) || dont_break;
-	do_scan = !do_update && timer_expired && !pause;
-	if (do_update) {
+	while (likely(!yld_test(yld, YLD_SHUTDOWN)) &&
+	       !yld_test(yld, YLD_SCAN_ACTIVE) &&
+	       (!(yld_test(yld, YLD_TIMER_EXPIRED) ||
+		  yld_test(yld, YLD_USB_PAUSE)) ||
+		update_in_progress(yld))) {
+		slot = get_ctl_slot(yld);
+		if (slot == NULL)
+			break;
 		/* find update candidates: copy != master */
-		do_update = prepare_update_cmd(yld);
-	}
-	yld->update_active = do_update;
-	yld->timer_expired = timer_expired && !do_scan;
-	yld->scan_active = do_scan;
-	spin_unlock(&yld->flags_lock);
-	YEALINK_DBG_FLAGS("  ");
-
-	if (do_update) {
-		pkt_update_checksum(yld->ctl_data, USB_PKT_LEN_G1);
-		if (likely(!yld->shutdown))
-			ret = usb_submit_urb(yld->urb_ctl, GFP_ATOMIC);
-	} else if (!yld->open) {
-		dev_dbg(&yld->intf->dev, "   stopping usb traffic");
-		up(&yld->usb_active_sem);	// @@@
-	} else if (do_scan) {
-		if (likely(!yld->shutdown))
-			ret = submit_scan_request(yld, GFP_ATOMIC);
-	} else {
-		dev_dbg(&yld->intf->dev, "   pausing updates");
+		if (!prepare_update_cmd(yld, slot))
+			break;
+		pkt_update_checksum(slot->data, USB_PKT_LEN_G1);
+		reply = cmd_expects_reply(slot->data->cmd);
+		if (reply) {
+			/* before the reply can arrive */
+			yld->scan_start = ktime_get();
+			yld_set(yld, YLD_SCAN_ACTIVE);
+		}
+		ret = submit_ctl_slot(yld, slot, mem_flags);
+		if (ret != 0) {
+			if (reply)
+				yld_clear(yld, YLD_SCAN_ACTIVE);
+			break;
+		}
 	}
-
+	yld_assign(yld, YLD_UPDATE_ACTIVE, (yld->ctl_busy != 0));
 	return ret;
 }
 
-/* Try to submit an update command to the device (G2 devices).
- * 
- * This function is invoked by the timer callback function to possibly
- * submit the next update command to the device.
+/* Prepare and submit a single update command (G2 devices).
  *
- * This function may be called from soft-irq context.
+ * YLD_UPDATE_ACTIVE is set before the URB is submitted, the command gap
+ * may have expired before usb_submit_urb() returns.
+ * Must be called by the owner of the update cycle.
  */
-static int perform_single_update_g2(struct yealink_dev *yld)
+static int queue_update_cmd_g2(struct yealink_dev *yld, int mem_flags)
 {
-	int do_update;
+	struct yld_ctl_slot *slot;
 	int ret = 0;
 
-	YEALINK_DBG_FLAGS("S:");
-	spin_lock_irq(&yld->flags_lock);
-	do_update = !yld->usb_pause;
-	if (do_update) {
-		/* find update candidates: copy != master */
-		do_update = prepare_update_cmd(yld);
-	}
-	yld->update_active = do_update;
-	yld->timer_expired = !do_update;
-	spin_unlock_irq(&yld->flags_lock);
-	YEALINK_DBG_FLAGS("  ");
-
-	if (do_update) {
-		pkt_update_checksum(yld->ctl_data, USB_PKT_LEN_G2);
-		if (likely(!yld->shutdown))
-			ret = usb_submit_urb(yld->urb_ctl, GFP_ATOMIC);
-	} else if (!yld->open) {
-		dev_dbg(&yld->intf->dev, "   stopping usb traffic");
-		up(&yld->usb_active_sem);	// @@@
-	} else {
-		dev_dbg(&yld->intf->dev, "   pausing updates");
+	slot = get_ctl_slot(yld);
+	if (slot != NULL && !yld_test(yld, YLD_USB_PAUSE) &&
+	    likely(!yld_test(yld, YLD_SHUTDOWN)) &&
+	    prepare_update_cmd(yld, slot)) {
+		pkt_update_checksum(slot->data, USB_PKT_LEN_G2);
+		yld_set(yld, YLD_UPDATE_ACTIVE);
+		ret = submit_ctl_slot(yld, slot, mem_flags);
+		if (ret != 0)
+			yld_clear(yld, YLD_UPDATE_ACTIVE);
 	}
-
 	return ret;
 }
 
-/* Timer callback function (G1 devices)
- * 
- * This function submits a pending key scan command.
+/* Called whenever the device may have become in sync with the master
+ * status. Completes a pending update from userspace and wakes up flush
+ * waiters. Must be called by the owner of the update cycle.
  */
-static void timer_callback_g1
-(
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
-    unsigned long ylda
-#else
-    struct timer_list *t
-#endif
-)
+static void check_update_done(struct yealink_dev *yld)
 {
-	struct yealink_dev *yld;
-	int timer_expired, idle;
-	int do_submit;
-	int ret = 0;
+	if (yld->ctl_busy || yld->notes_wait ||
+	    !bitmap_empty(yld->dirty, sizeof(struct yld_status)))
+		return;
+	if (yld_test(yld, YLD_UPDATE_WAIT)) {
+		/* all changes from userspace have reached the device */
+		hist_add(&yld->lat_update, yld->update_start, ktime_get());
+		yld->update_start = ktime_set(0, 0);
+		yld->update_gen++;
+		yld_clear(yld, YLD_UPDATE_WAIT);
+		schedule_work(&yld->notify_work);
+	}
+	wake_up_all(&yld->update_wq);
+}
 
-#	if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
-	yld = (struct yealink_dev *)ylda;
-#	else
-	yld = from_timer(yld, t, timer);
-#	endif
+static void update_notify_work(struct work_struct *work)
+{
+	struct yealink_dev *yld = container_of(work, struct yealink_dev,
+					       notify_work);
 
-	YEALINK_DBG_FLAGS("T:");
-	spin_lock_irq(&yld->flags_lock);
-	timer_expired = yld->timer_expired;
-	idle = !yld->update_active && !yld->scan_active;
-	do_submit = idle && !yld->usb_pause;
-	yld->scan_active = yld->scan_active || do_submit;
-	yld->timer_expired = !do_submit;
-	spin_unlock_irq(&yld->flags_lock);
-	YEALINK_DBG_FLAGS("  ");
-
-	if (unlikely(timer_expired))
-		dev_warn(&yld->intf->dev, "timeout was not serviced in time!");
+	sysfs_notify(&yld->intf->dev.kobj, NULL, "update_gen");
+}
 
-	if (likely(!yld->shutdown)) {
-		mod_timer(&yld->timer, jiffies + yld->timer_delay);
-		if (do_submit) {
-			ret = submit_scan_request(yld, GFP_ATOMIC);
+/* Ownership of the update cycle
+ *
+ * The control queue, copy and dirty, the ring note sequence and the latency
+ * timestamps of the cycle are only touched by the context owning the cycle
+ * (YLD_CYCLE). URB callbacks and timers never wait for it: run_cycle()
+ * records their event in the state word and claims the cycle with a single
+ * cmpxchg. If the cycle is owned already, YLD_CYCLE_AGAIN is set instead
+ * and the owner runs the cycle once more before handing it back, so the
+ * event is always seen. Only process context waits for the cycle, with
+ * yld_cycle_lock().
+ */
+
+/* Records an event and claims the cycle, returns the previous state.
+ * The claim failed if YLD_CYCLE was already set in it.
+ */
+static unsigned long cycle_claim(struct yealink_dev *yld, unsigned long set,
+				 unsigned long clear)
+{
+	unsigned long old, new, prev;
+
+	old = READ_ONCE(yld->state);
+	for (;;) {
+		new = (old | set) & ~clear;
+		if (old & BIT(YLD_CYCLE))
+			new |= BIT(YLD_CYCLE_AGAIN);
+		else
+			new |= BIT(YLD_CYCLE);
+		prev = cmpxchg(&yld->state, old, new);
+		if (prev == old)
+			return old;
+		old = prev;
+	}
+}
+
+/* Hands the cycle back. Returns 0 if an event came in meanwhile, the caller
+ * still owns the cycle then and has to run it again.
+ */
+static int cycle_release(struct yealink_dev *yld)
+{
+	unsigned long old, new, prev;
+
+	old = READ_ONCE(yld->state);
+	for (;;) {
+		if (old & BIT(YLD_CYCLE_AGAIN))
+			new = old & ~BIT(YLD_CYCLE_AGAIN);
+		else
+			new = old & ~BIT(YLD_CYCLE);
+		prev = cmpxchg(&yld->state, old, new);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+	if (old & BIT(YLD_CYCLE_AGAIN))
+		return 0;
+	if ((new & BIT(YLD_USB_PAUSE)) &&
+	    !(new & (BIT(YLD_SCAN_ACTIVE) | BIT(YLD_UPDATE_ACTIVE))))
+		wake_up_all(&yld->idle_wq);
+	return 1;
+}
+
+/* Runs the cycle once, called by its owner */
+static int cycle_step(struct yealink_dev *yld)
+{
+	int ret;
+
+	check_notes_sent(yld);
+	if (test_and_clear_bit(YLD_UPDATE_REQ, &yld->state)) {
+		if (!yld_test(yld, YLD_UPDATE_WAIT)) {
+			yld->update_start = ktime_get();
+			yld_set(yld, YLD_UPDATE_WAIT);
 		}
 	}
-	if (ret)
-		dev_err(&yld->intf->dev, "%s - urb submission failed %d", __FUNCTION__, ret);
+	ret = yld->model->engine->step(yld);
+	check_update_done(yld);
+	return ret;
 }
 
-/* Timer callback function (G2 devices)
- * 
- * This function submits a pending key scan command.
+/* Records an event (YLD_* bits to set and clear) and runs the cycle, or
+ * leaves it to the current owner. Never waits, may be called from hard-irq
+ * context. Returns the result of the last step run by the caller.
+ * The cycle is owned with preemption disabled, so yld_cycle_lock() never
+ * spins on a preempted process context owner.
+ */
+static int run_cycle(struct yealink_dev *yld, unsigned long set,
+		     unsigned long clear)
+{
+	int ret = 0;
+
+	preempt_disable();
+	if (!(cycle_claim(yld, set, clear) & BIT(YLD_CYCLE))) {
+		do {
+			ret = cycle_step(yld);
+		} while (!cycle_release(yld));
+	}
+	preempt_enable();
+	return ret;
+}
+
+/* Waits for the cycle and owns it (process context only). Every owner
+ * runs with preemption disabled or in interrupt context, so the owner
+ * keeps running while others wait here.
+ */
+static void yld_cycle_lock(struct yealink_dev *yld)
+{
+	unsigned long old;
+
+	preempt_disable();
+	for (;;) {
+		old = READ_ONCE(yld->state);
+		if (!(old & BIT(YLD_CYCLE)) &&
+		    cmpxchg(&yld->state, old, old | BIT(YLD_CYCLE)) == old)
+			break;
+		cpu_relax();
+	}
+}
+
+/* Hands the cycle back, running it for the events recorded meanwhile */
+static void yld_cycle_unlock(struct yealink_dev *yld)
+{
+	int ret;
+
+	while (!cycle_release(yld)) {
+		ret = cycle_step(yld);
+		if (ret)
+			dev_err(&yld->intf->dev, "%s - urb submission failed %d", __FUNCTION__, ret);
+	}
+	preempt_enable();
+}
+
+static int is_quiesced(struct yealink_dev *yld)
+{
+	return !(READ_ONCE(yld->state) & (BIT(YLD_SCAN_ACTIVE) |
+		 BIT(YLD_UPDATE_ACTIVE) | BIT(YLD_CYCLE)));
+}
+
+/* Pause the update/scan cycle and wait until no URB is in flight anymore.
+ *
+ * The owner of the cycle stops it after the current transfer and wakes up
+ * idle_wq. On success the cycle stays paused until start_traffic() is
+ * called, on timeout it is resumed again.
+ * May sleep.
+ */
+static int quiesce_updates(struct yealink_dev *yld)
+{
+	long ret;
+
+	YEALINK_TRACE_FLAGS("enter");
+	yld_set(yld, YLD_USB_PAUSE);
+
+	ret = wait_event_timeout(yld->idle_wq, is_quiesced(yld),
+				 msecs_to_jiffies(YEALINK_QUIESCE_TIMEOUT));
+	YEALINK_TRACE_FLAGS("exit");
+	if (ret == 0) {
+		yld_clear(yld, YLD_USB_PAUSE);
+		return -ETIMEDOUT;
+	}
+	return 0;
+}
+
+/* Reactivate the update cycle if currently not active.
+ *
+ * This function is usually called by userspace after modifying the
+ * master status. If the update cycle is currently not active then the
+ * next update commands are determined and sent to the device, otherwise
+ * the running cycle picks up the changes.
+ */
+static int poke_update_from_userspace(struct yealink_dev *yld)
+{
+	int ret;
+
+	//BUG_ON(yld_test(yld, YLD_USB_PAUSE));	@@@
+	if (yld_test(yld, YLD_USB_PAUSE))
+		return 0;
+
+	YEALINK_TRACE_FLAGS("enter");
+	ret = run_cycle(yld, BIT(YLD_UPDATE_REQ), 0);
+	YEALINK_TRACE_FLAGS("exit");
+	return ret;
+}
+
+/* Cycle step (G1 devices)
+ *
+ * Refills the control queue with update commands unless a reply is
+ * pending, then submits the key scan if it is due and the queue has
+ * drained. Run for every completed URB, every timer tick and every poke.
+ */
+static int step_g1(struct yealink_dev *yld)
+{
+	int do_scan, stopped;
+	int ret;
+
+	YEALINK_TRACE_FLAGS("enter");
+	ret = queue_update_cmds_g1(yld, GFP_ATOMIC);
+	stopped = !yld_busy(yld);
+	do_scan = stopped && yld_test(yld, YLD_TIMER_EXPIRED) &&
+		  !yld_test(yld, YLD_USB_PAUSE) &&
+		  likely(!yld_test(yld, YLD_SHUTDOWN));
+	if (do_scan) {
+		ret = submit_scan_request(yld, GFP_ATOMIC);
+		if (ret == 0)
+			yld_clear(yld, YLD_TIMER_EXPIRED);
+	}
+	YEALINK_TRACE_FLAGS("exit");
+
+	if (!stopped || do_scan) {
+		/* usb traffic continues */
+	} else if (!yld_test(yld, YLD_OPEN)) {
+		dev_dbg(&yld->intf->dev, "   stopping usb traffic");
+	} else {
+		dev_dbg(&yld->intf->dev, "   pausing updates");
+	}
+
+	return ret;
+}
+
+/* Cycle step (G2 devices)
+ *
+ * YLD_UPDATE_ACTIVE stays set from the submission of a command until its
+ * command gap has expired, see timer_callback_g2(). Only then the next
+ * update command is submitted.
+ */
+static int step_g2(struct yealink_dev *yld)
+{
+	int ret;
+
+	if (yld_test(yld, YLD_UPDATE_ACTIVE))
+		return 0;
+
+	YEALINK_TRACE_FLAGS("enter");
+	ret = queue_update_cmd_g2(yld, GFP_ATOMIC);
+	YEALINK_TRACE_FLAGS("exit");
+
+	if (yld_test(yld, YLD_UPDATE_ACTIVE)) {
+		/* usb traffic continues */
+	} else if (!yld_test(yld, YLD_OPEN)) {
+		dev_dbg(&yld->intf->dev, "   stopping usb traffic");
+	} else {
+		dev_dbg(&yld->intf->dev, "   pausing updates");
+	}
+
+	return ret;
+}
+
+/* Switch to the fast key/hook polling rate for a while (G1 devices) */
+static inline void poll_fast(struct yealink_dev *yld)
+{
+	yld->poll_fast_until = jiffies + yld->poll_hold;
+}
+
+/* Returns the delay until the next key/hook scan (G1 devices) */
+static inline unsigned long poll_delay(struct yealink_dev *yld)
+{
+	if (time_before(jiffies, yld->poll_fast_until))
+		return yld->poll_fast_delay;
+	return yld->timer_delay;
+}
+
+/* PSTN ring cadence (B2K, B3G)
+ *
+ * The ring bit follows the ring signal, so an incoming call is a sequence
+ * of rings and pauses. YEALINK_KEY_PSTN_CALL is pressed once the ring bit
+ * has been set for ring_debounce and released when it stayed cleared for
+ * ring_end.
+ */
+enum yld_ring_state {
+	YLD_RING_IDLE,		/* no incoming call */
+	YLD_RING_DEBOUNCE,	/* first ring, not reported yet */
+	YLD_RING_ACTIVE		/* incoming call reported */
+};
+
+static void report_ring(struct yealink_dev *yld, int on)
+{
+	if (!yld_test(yld, YLD_OPEN))
+		return;
+	input_report_key(yld->idev, YEALINK_KEY_PSTN_CALL, on);
+	input_sync(yld->idev);
+}
+
+/* Called from the irq callback on every change of the ring bit.
+ * ring_state is only changed with cmpxchg, timer_callback_ring() may move
+ * it on at the same time.
  */
-static void timer_callback_g2
+static void ring_sample(struct yealink_dev *yld, int ring)
+{
+	int state;
+
+	for (;;) {
+		state = READ_ONCE(yld->ring_state);
+		switch (state) {
+		case YLD_RING_IDLE:
+			if (!ring)
+				return;
+			if (cmpxchg(&yld->ring_state, state,
+				    YLD_RING_DEBOUNCE) != state)
+				continue;
+			mod_timer(&yld->ring_timer, jiffies + yld->ring_debounce);
+			return;
+		case YLD_RING_DEBOUNCE:
+			if (ring)
+				return;
+			if (cmpxchg(&yld->ring_state, state,
+				    YLD_RING_IDLE) != state)
+				continue;
+			del_timer(&yld->ring_timer);
+			return;
+		case YLD_RING_ACTIVE:
+			if (!ring)
+				mod_timer(&yld->ring_timer, jiffies + yld->ring_end);
+			return;
+		}
+	}
+}
+
+static void timer_callback_ring
 (
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
     unsigned long ylda
@@ -1241,9 +2024,53 @@ static void timer_callback_g2
     struct timer_list *t
 #endif
 )
+{
+	struct yealink_dev *yld;
+	int state, event;
+	int ret;
+
+#	if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+	yld = (struct yealink_dev *)ylda;
+#	else
+	yld = from_timer(yld, t, ring_timer);
+#	endif
+
+	state = READ_ONCE(yld->ring_state);
+	if (state == YLD_RING_DEBOUNCE && yld->pstn_ring)
+		event = 1;
+	else if (state == YLD_RING_ACTIVE && !yld->pstn_ring)
+		event = 0;
+	else
+		return;
+	/* ring_sample() may have ended the debounce meanwhile */
+	if (cmpxchg(&yld->ring_state, state,
+		    event ? YLD_RING_ACTIVE : YLD_RING_IDLE) != state)
+		return;
+	report_ring(yld, event);
+	if (event && yld->pstn_auto) {
+		set_status_byte(yld, offsetof(struct yld_status, pstn), 1);
+		ret = poke_update_from_userspace(yld);
+		if (ret)
+			dev_err(&yld->intf->dev, "%s - urb submission failed %d", __FUNCTION__, ret);
+	}
+}
 
+/* Timer callback function (G1 devices)
+ * 
+ * This function marks the key scan as due, step_g1() submits it as soon
+ * as the control queue has drained.
+ */
+static void timer_callback_g1
+(
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+    unsigned long ylda
+#else
+    struct timer_list *t
+#endif
+)
 {
 	struct yealink_dev *yld;
+	int timer_expired;
 	int ret;
 
 #	if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
@@ -1252,9 +2079,79 @@ static void timer_callback_g2
 	yld = from_timer(yld, t, timer);
 #	endif
 
-	ret = perform_single_update_g2(yld);
+	YEALINK_TRACE_FLAGS("enter");
+	timer_expired = test_and_set_bit(YLD_TIMER_EXPIRED, &yld->state);
+	ret = run_cycle(yld, 0, 0);
+	YEALINK_TRACE_FLAGS("exit");
+
+	if (unlikely(timer_expired)) {
+		atomic_long_inc(&yld->cnt.timer_late);
+		dev_warn(&yld->intf->dev, "timeout was not serviced in time!");
+	}
+
+	if (likely(!yld_test(yld, YLD_SHUTDOWN)))
+		mod_timer(&yld->timer, jiffies + poll_delay(yld));
+	if (ret)
+		dev_err(&yld->intf->dev, "%s - urb submission failed %d", __FUNCTION__, ret);
+}
+
+/* Timer callback function (G2 devices)
+ * 
+ * The command gap has expired: YLD_UPDATE_ACTIVE is cleared, so step_g2()
+ * submits the next update command.
+ */
+static enum hrtimer_restart timer_callback_g2(struct hrtimer *t)
+{
+	struct yealink_dev *yld;
+	int ret;
+
+	yld = container_of(t, struct yealink_dev, cmd_timer);
+	YEALINK_TRACE_FLAGS("expired");
+
+	ret = run_cycle(yld, 0, BIT(YLD_UPDATE_ACTIVE));
 	if (ret)
 		dev_err(&yld->intf->dev, "%s - urb submission failed %d", __FUNCTION__, ret);
+	return HRTIMER_NORESTART;
+}
+
+/* The G2 cycle was cancelled between two commands (pacing timer stopped
+ * or not started under YLD_SHUTDOWN), nothing else will clear
+ * YLD_UPDATE_ACTIVE anymore. Without this quiesce_updates() would wait
+ * for its timeout on the next open. step_g2() does not submit anything
+ * under YLD_SHUTDOWN.
+ */
+static void update_cycle_dropped(struct yealink_dev *yld)
+{
+	run_cycle(yld, 0, BIT(YLD_UPDATE_ACTIVE));
+}
+
+/* Stop the key/hook scan timer and the command pacing timer.
+ * The timers are re-armed by start_traffic(), so they are cancelled on
+ * every call once probe has set them up.
+ */
+static void cancel_timers(struct yealink_dev *yld)
+{
+	int active;
+
+	if (yld_test(yld, YLD_TIMER_ACTIVE)) {
+		del_timer_sync(&yld->timer);
+		if (hrtimer_cancel(&yld->cmd_timer))
+			update_cycle_dropped(yld);
+	}
+	del_timer_sync(&yld->ring_timer);
+	active = (xchg(&yld->ring_state, YLD_RING_IDLE) == YLD_RING_ACTIVE);
+	if (active) {
+		/* end the incoming call, even if the device was closed */
+		input_report_key(yld->idev, YEALINK_KEY_PSTN_CALL, 0);
+		input_sync(yld->idev);
+	}
+}
+
+/* URB killed by suspend, close or disconnect, not counted as an error */
+static inline int urb_killed(int status)
+{
+	return status == -ENOENT || status == -ECONNRESET ||
+	       status == -ESHUTDOWN;
 }
 
 /*
@@ -1267,33 +2164,49 @@ static void urb_irq_callback(struct urb *urb)
 {
 	struct yealink_dev *yld = urb->context;
 	const int status = urb->status;
-	enum yld_ctl_protocols proto;
+	const struct yld_engine *engine;
+	ktime_t now;
 	u8 data0;
 	int ret = 0;
 
-	proto = yld->model->protocol;
-	data0 = (proto == yld_ctl_protocol_g1) ?
-	          yld->irq_data->g1.data[0] : yld->irq_data->g2.data[0];
+	now = ktime_get();
+	engine = yld->model->engine;
+	data0 = ((u8 *) yld->irq_data)[engine->data_ofs];
+	trace_yealink_irq(&yld->intf->dev, yld->irq_data->cmd, data0, status);
 
 	if (unlikely(status)) {
 		if (status == -ESHUTDOWN)
 			return;
-		dev_err(&yld->intf->dev, "%s - urb status %d", __FUNCTION__, status);
+		if (!urb_killed(status)) {
+			atomic_long_inc(&yld->cnt.irq_urb_err);
+			dev_err(&yld->intf->dev, "%s - urb status %d", __FUNCTION__, status);
+		}
 		goto send_next;		/* do not process the irq_data */
 	}
+	count_rx(yld, yld->irq_data->cmd, urb->actual_length);
 
 	dev_dbg(&urb->dev->dev, "### URB IRQ: cmd=0x%02x, data0=0x%02x\n",
 		yld->irq_data->cmd, data0);
 
-	if (unlikely(pkt_verify_checksum(yld->irq_data, USB_PKT_LEN(proto)) != 0)) {
+	if (unlikely(engine->verify(yld->irq_data) != 0)) {
+		atomic_long_inc(&yld->cnt.csum_err);
 		dev_warn(&yld->intf->dev, "Received packet with invalid checksum, dropping it");
 		goto send_next;		/* do not process the irq_data */
 	}
 
+	/* G2 phones send their replies unsolicited */
+	if (engine == &yld_engine_g1 &&
+	    cmd_expects_reply(yld->irq_data->cmd))
+		hist_add(&yld->lat_scan, yld->scan_start, now);
+
 	switch (yld->irq_data->cmd) {
 	case CMD_KEYPRESS:
-		yld->master.s.keynum = data0;
-		if (yld->model->name != b3g_model)
+		if (yld->master.s.keynum != data0) {
+			poll_fast(yld);
+			yld->key_start = yld->scan_start;
+		}
+		set_status_byte(yld, offsetof(struct yld_status, keynum), data0);
+		if (!yld->model->key_status)
 			break;
 		/* prepare to fall through (B3G) */
 		data0 = yld->irq_data->g1.data[1];
@@ -1303,7 +2216,8 @@ static void urb_irq_callback(struct urb *urb)
 		/* B2K + B3G (fall-through) */
 		ret = data0 & 0x01;		/* PSTN ring */
 		if (yld->pstn_ring != ret) {
-			if (yld->open) {
+			poll_fast(yld);
+			if (yld_test(yld, YLD_OPEN)) {
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
 				input_regs(yld->idev, regs);
 #endif
@@ -1311,10 +2225,11 @@ static void urb_irq_callback(struct urb *urb)
 				input_sync(yld->idev);
 			}
 			yld->pstn_ring = ret;
+			ring_sample(yld, ret);
 		}
 		/* prepare to fall through (B2K & B3G) */
-		data0 = (yld->model->name == b2k_model) ? (~data0 << 3) :
-				(yld->irq_data->g1.data[2] << 4);
+		data0 = yld->model->key_status ?
+				(yld->irq_data->g1.data[2] << 4) : (~data0 << 3);
 		fallthrough;
 
 	case CMD_HOOKPRESS:
@@ -1322,7 +2237,9 @@ static void urb_irq_callback(struct urb *urb)
 		ret = ~data0 & 0x10;
 		if (yld->hookstate == ret)
 			break;
-		if (yld->open) {
+		poll_fast(yld);
+		hist_add(&yld->lat_key, yld->scan_start, now);
+		if (yld_test(yld, YLD_OPEN)) {
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
 			input_regs(yld->idev, regs);
 #endif
@@ -1333,8 +2250,12 @@ static void urb_irq_callback(struct urb *urb)
 		break;
 
 	case CMD_SCANCODE:
+		if (ktime_to_ns(yld->key_start) != 0) {
+			hist_add(&yld->lat_key, yld->key_start, now);
+			yld->key_start = ktime_set(0, 0);
+		}
 		ret = yld->model->keycode(data0);
-		if (yld->open)
+		if (yld_test(yld, YLD_OPEN))
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
 			report_key(yld, ret, regs);
 #else
@@ -1345,21 +2266,17 @@ static void urb_irq_callback(struct urb *urb)
 		break;
 
 	case STATE_BAD_PKT:
+		atomic_long_inc(&yld->cnt.bad_pkt);
 		dev_warn(&yld->intf->dev, "phone received invalid command packet");
 		break;
 
 	default:
+		atomic_long_inc(&yld->cnt.unexpected);
 		dev_err(&yld->intf->dev, "unexpected response %x", yld->irq_data->cmd);
 	}
 
 send_next:
-	if (proto == yld_ctl_protocol_g1) {
-		ret = perform_single_update_g1(yld);
-	} else {
-		/* always wait for a key or some other interrupt */
-		if (likely(!yld->shutdown))
-			ret = usb_submit_urb(yld->urb_irq, GFP_ATOMIC);
-	}
+	ret = engine->irq_next(yld);
 	if (ret)
 		dev_err(&yld->intf->dev, "%s - urb submission failed %d", __FUNCTION__, ret);
 }
@@ -1374,94 +2291,305 @@ static void urb_ctl_callback(struct urb *urb, struct pt_regs *regs)
 static void urb_ctl_callback(struct urb *urb)
 #endif
 {
-	struct yealink_dev *yld = urb->context;
+	struct yld_ctl_slot *slot = urb->context;
+	struct yealink_dev *yld = slot->yld;
 	int status = urb->status;
+	u8 cmd = slot->data->cmd;	/* the slot is reused once released */
 	int ret = 0;
 
+	trace_yealink_ctl_complete(&yld->intf->dev, cmd, status);
+
+	/* seen by the next cycle step, see check_notes_sent() */
+	if (unlikely(status) && cmd == CMD_RING_NOTE)
+		set_bit(YLD_NOTES_LOST, &yld->state);
+	if (slot->notes_end)
+		set_bit(YLD_NOTES_DONE, &yld->state);
+	/* release the queue slot */
+	clear_bit(slot - yld->ctl, &yld->ctl_busy);
+
 	if (unlikely(status)) {
 		if (status == -ESHUTDOWN)
 			return;
-		dev_err(&yld->intf->dev, "%s - urb status %d", __FUNCTION__, status);
-	}
-
-	if (yld->model->protocol == yld_ctl_protocol_g2) {
-		if (likely(!yld->shutdown))
-			mod_timer(&yld->timer, jiffies + yld->timer_delay);
-		return;
-	}
-
-	/* yld_ctl_protocol_g1 */
-	switch (yld->ctl_data->cmd) {
-	case CMD_HOOKPRESS:
-	case CMD_HANDSET:
-	case CMD_KEYPRESS:
-	case CMD_SCANCODE:
-		/* Expect a response on the irq endpoint! */
-		if (likely(!yld->shutdown))
-			ret = usb_submit_urb(yld->urb_irq, GFP_ATOMIC);
-		break;
-	default:
-		/* immediately send new command */
-		ret = perform_single_update_g1(yld);
+		if (!urb_killed(status)) {
+			atomic_long_inc(&yld->cnt.ctl_urb_err);
+			dev_err(&yld->intf->dev, "%s - urb status %d", __FUNCTION__, status);
+		}
+	} else {
+		count_tx(yld, cmd, urb->actual_length);
 	}
 
+	ret = yld->model->engine->ctl_next(yld, cmd);
 	if (ret)
 		dev_err(&yld->intf->dev, "%s - urb submission failed %d", __FUNCTION__, ret);
 }
 
-/*******************************************************************************
- * sysfs interface
- ******************************************************************************/
-
-/* Interface to the 7-segments translation table aka. char set.
+/* The packet size is a constant of each engine, so that the checksum loop
+ * is unrolled for it.
  */
-static ssize_t show_map(struct device *dev, struct device_attribute *attr,
-				char *buf)
+static int verify_g1(union yld_ctl_packet *p)
 {
-	memcpy(buf, &map_seg7, sizeof(map_seg7));
-	return sizeof(map_seg7);
+	return pkt_verify_checksum(p, USB_PKT_LEN_G1);
 }
 
-static ssize_t store_map(struct device *dev, struct device_attribute *attr,
-				const char *buf, size_t cnt)
+static int verify_g2(union yld_ctl_packet *p)
 {
-	if (cnt != sizeof(map_seg7))
-		return -EINVAL;
-	memcpy(&map_seg7, buf, sizeof(map_seg7));
-	return sizeof(map_seg7);
+	return pkt_verify_checksum(p, USB_PKT_LEN_G2);
 }
 
-/* Interface to the LCD.
- */
+/* Continue after an irq URB (G1 devices): any expected reply has arrived */
+static int irq_next_g1(struct yealink_dev *yld)
+{
+	return run_cycle(yld, 0, BIT(YLD_SCAN_ACTIVE));
+}
 
-/* Reading /sys/../lineX will return the format string with its settings:
- *
- * Example:
- * cat ./line3
- * 888888888888
- * Linux Rocks!
- */
-static ssize_t show_line(struct device *dev, char *buf, int a, int b)
+/* Continue after an irq URB (G2 devices) */
+static int irq_next_g2(struct yealink_dev *yld)
 {
-	struct yealink_dev *yld;
-	int i;
+	/* always wait for a key or some other interrupt */
+	if (likely(!yld_test(yld, YLD_SHUTDOWN)))
+		return usb_submit_urb(yld->urb_irq, GFP_ATOMIC);
+	return 0;
+}
 
-	down_read(&sysfs_rwsema);
-	yld = dev_get_drvdata(dev);
-	if (unlikely(yld == NULL)) {
-		up_read(&sysfs_rwsema);
-		return -ENODEV;
-	}
+/* Continue after a control URB (G1 devices) */
+static int ctl_next_g1(struct yealink_dev *yld, u8 cmd)
+{
+	int ret = 0;
 
-	for (i = a; i < b; i++)
-		*buf++ = lcdMap[i].type;
-	*buf++ = '\n';
-	for (i = a; i < b; i++)
+	if (cmd_expects_reply(cmd)) {
+		/* Expect a response on the irq endpoint! */
+		if (likely(!yld_test(yld, YLD_SHUTDOWN)))
+			ret = usb_submit_urb(yld->urb_irq, GFP_ATOMIC);
+	}
+	/* refill the control queue, step_g1() waits for a pending reply */
+	if (ret == 0)
+		ret = run_cycle(yld, 0, 0);
+	return ret;
+}
+
+/* Continue after a control URB (G2 devices): wait for the command gap */
+static int ctl_next_g2(struct yealink_dev *yld, u8 cmd)
+{
+	if (unlikely(yld_test(yld, YLD_SHUTDOWN))) {
+		update_cycle_dropped(yld);
+		return 0;
+	}
+	hrtimer_start(&yld->cmd_timer,
+		      ktime_set(0, yld->cmd_gap_us * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+	/* YLD_UPDATE_ACTIVE stays set, step_g2() only completes the update */
+	return run_cycle(yld, 0, 0);
+}
+
+static int start_g1(struct yealink_dev *yld, int with_key_scan)
+{
+	/* start the periodic scan timer */
+	if (with_key_scan)
+		mod_timer(&yld->timer, jiffies + yld->timer_delay);
+	return 0;
+}
+
+static int start_g2(struct yealink_dev *yld, int with_key_scan)
+{
+	/* immediately start waiting for a key */
+	if (with_key_scan)
+		return usb_submit_urb(yld->urb_irq, GFP_KERNEL);
+	return 0;
+}
+
+static const struct yld_engine yld_engine_g1 = {
+	.data_ofs	= offsetof(struct yld_ctl_packet_g1, data),
+	.verify		= verify_g1,
+	.start		= start_g1,
+	.step		= step_g1,
+	.irq_next	= irq_next_g1,
+	.ctl_next	= ctl_next_g1,
+};
+
+static const struct yld_engine yld_engine_g2 = {
+	.data_ofs	= offsetof(struct yld_ctl_packet_g2, data),
+	.verify		= verify_g2,
+	.start		= start_g2,
+	.step		= step_g2,
+	.irq_next	= irq_next_g2,
+	.ctl_next	= ctl_next_g2,
+};
+
+/*******************************************************************************
+ * sysfs interface
+ ******************************************************************************/
+
+/* Lifetime of struct yealink_dev
+ *
+ * The sysfs functions look up the device under rcu_read_lock() and hold a
+ * reference while they use it, so they only serialize against other users
+ * of the same phone. usb_disconnect() clears the driver data under the
+ * write lock, waits for an RCU grace period and drops the reference of the
+ * USB binding. The last reference frees the structure. It also holds a
+ * reference on the interface, so users like an open /dev/yealinkN can
+ * still find the driver data cleared after the phone was unplugged.
+ */
+static void yld_release(struct kref *kref)
+{
+	struct yealink_dev *yld = container_of(kref, struct yealink_dev, kref);
+	int i;
+
+	kfree(rcu_dereference_protected(yld->seg7, 1));
+	free_page((unsigned long) yld->fb);
+	kfree(yld->notes_buf[0]);
+	kfree(yld->notes_buf[1]);
+	for (i = 0; i < YEALINK_RING_SLOTS; i++)
+		kfree(yld->ring_slot[i]);
+	usb_put_intf(yld->intf);
+	kfree(yld);
+}
+
+/* Returns the device with a reference held, or NULL if the phone has been
+ * disconnected.
+ */
+static struct yealink_dev *yld_get(struct device *dev)
+{
+	struct yealink_dev *yld;
+
+	rcu_read_lock();
+	yld = dev_get_drvdata(dev);
+	if (yld)
+		kref_get(&yld->kref);
+	rcu_read_unlock();
+	return yld;
+}
+
+static void yld_put(struct yealink_dev *yld)
+{
+	kref_put(&yld->kref, yld_release);
+}
+
+/* Takes the sysfs lock of a referenced device, fails if the phone has been
+ * disconnected in the meantime.
+ */
+static int yld_lock(struct yealink_dev *yld, int write)
+{
+	if (write)
+		down_write(&yld->sysfs_rwsem);
+	else
+		down_read(&yld->sysfs_rwsem);
+	if (unlikely(usb_get_intfdata(yld->intf) == NULL)) {
+		if (write)
+			up_write(&yld->sysfs_rwsem);
+		else
+			up_read(&yld->sysfs_rwsem);
+		return -ENODEV;
+	}
+	return 0;
+}
+
+static void yld_unlock(struct yealink_dev *yld, int write)
+{
+	if (write)
+		up_write(&yld->sysfs_rwsem);
+	else
+		up_read(&yld->sysfs_rwsem);
+}
+
+/* Returns the device with a reference and its sysfs lock held, or NULL if
+ * the phone has been disconnected.
+ */
+static struct yealink_dev *yld_sysfs_get(struct device *dev, int write)
+{
+	struct yealink_dev *yld;
+
+	yld = yld_get(dev);
+	if (unlikely(yld == NULL))
+		return NULL;
+	if (yld_lock(yld, write) != 0) {
+		yld_put(yld);
+		return NULL;
+	}
+	return yld;
+}
+
+static void yld_sysfs_put(struct yealink_dev *yld, int write)
+{
+	yld_unlock(yld, write);
+	yld_put(yld);
+}
+
+/* Interface to the 7-segments translation table aka. char set.
+ *
+ * Each phone has its own char set. A new table is published with
+ * rcu_assign_pointer(), so setChars() never sees a partially written one.
+ */
+static ssize_t show_map(struct device *dev, struct device_attribute *attr,
+				char *buf)
+{
+	struct yealink_dev *yld;
+
+	yld = yld_sysfs_get(dev, 0);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+	rcu_read_lock();
+	memcpy(buf, rcu_dereference(yld->seg7), sizeof(map_seg7));
+	rcu_read_unlock();
+	yld_sysfs_put(yld, 0);
+	return sizeof(map_seg7);
+}
+
+static ssize_t store_map(struct device *dev, struct device_attribute *attr,
+				const char *buf, size_t cnt)
+{
+	struct yealink_dev *yld;
+	struct seg7_conversion_map *map, *old;
+
+	if (cnt != sizeof(map_seg7))
+		return -EINVAL;
+	map = kmemdup(buf, sizeof(map_seg7), GFP_KERNEL);
+	if (map == NULL)
+		return -ENOMEM;
+
+	yld = yld_sysfs_get(dev, 1);
+	if (unlikely(yld == NULL)) {
+		kfree(map);
+		return -ENODEV;
+	}
+	old = rcu_dereference_protected(yld->seg7, 1);
+	rcu_assign_pointer(yld->seg7, map);
+	/* the next write of a char renders it with the new char set */
+	bitmap_fill(yld->lcd_stale, ARRAY_SIZE(lcdMap));
+	yld_sysfs_put(yld, 1);
+
+	synchronize_rcu();
+	kfree(old);
+	return sizeof(map_seg7);
+}
+
+/* Interface to the LCD.
+ */
+
+/* Reading /sys/../lineX will return the format string with its settings:
+ *
+ * Example:
+ * cat ./line3
+ * 888888888888
+ * Linux Rocks!
+ */
+static ssize_t show_line(struct device *dev, char *buf, int a, int b)
+{
+	struct yealink_dev *yld;
+	int i;
+
+	yld = yld_sysfs_get(dev, 0);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+
+	for (i = a; i < b; i++)
+		*buf++ = lcdMap[i].type;
+	*buf++ = '\n';
+	for (i = a; i < b; i++)
 		*buf++ = yld->lcdMap[i];
 	*buf++ = '\n';
 	*buf = 0;
 
-	up_read(&sysfs_rwsema);
+	yld_sysfs_put(yld, 0);
 	return 3 + ((b - a) << 1);
 }
 
@@ -1494,29 +2622,24 @@ static ssize_t store_line(struct device *dev, const char *buf, size_t count,
 		int el, size_t len, int submit)
 {
 	struct yealink_dev *yld;
-	int i;
 	int ret = count;
 
-	down_write(&sysfs_rwsema);
-	yld = dev_get_drvdata(dev);
-	if (unlikely(yld == NULL)) {
-		up_write(&sysfs_rwsema);
+	yld = yld_sysfs_get(dev, 1);
+	if (unlikely(yld == NULL))
 		return -ENODEV;
-	}
-	if (!yld->model->fcheck(offsetof(struct yld_status, lcd))) {
-		up_write(&sysfs_rwsema);
+	if (!has_feature(yld->model, offsetof(struct yld_status, lcd))) {
+		yld_sysfs_put(yld, 1);
 		return ret;
 	}
 
 	if (len > count)
 		len = count;
-	for (i = 0; i < len; i++)
-		setChar(yld, el++, buf[i]);
+	setChars(yld, el, buf, len);
 
 	if (submit && (poke_update_from_userspace(yld) != 0))
 		ret = -ERESTARTSYS;
 
-	up_write(&sysfs_rwsema);
+	yld_sysfs_put(yld, 1);
 
 	return ret;
 }
@@ -1539,160 +2662,580 @@ static ssize_t store_line3(struct device *dev, struct device_attribute *attr,
 	return store_line(dev, buf, count, LCD_LINE3_OFFSET, LCD_LINE3_SIZE, 1);
 }
 
+/* Interface to the complete display state.
+ *
+ * /sys/../frame covers line 1 to 3 followed by the LED, DIALTONE, RINGTONE,
+ * BACKLIGHT, SPEAKER and PSTN icons, with the same format as lineX.
+ * A write is applied while the update cycle is blocked and then triggers a
+ * single update, so the phone never shows a partially updated frame.
+ * Elements not supported by the model are ignored.
+ */
+static ssize_t show_frame(struct device *dev, struct device_attribute *attr,
+			char *buf)
+{
+	return show_line(dev, buf, LCD_LINE1_OFFSET, ARRAY_SIZE(lcdMap));
+}
+
+static ssize_t store_frame(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct yealink_dev *yld;
+	char frame[ARRAY_SIZE(lcdMap)];
+	size_t i, len;
+	int a;
+	int ret = count;
+
+	yld = yld_sysfs_get(dev, 1);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+
+	len = min(count, ARRAY_SIZE(lcdMap));
+	for (i = 0; i < len; i++) {
+		a = (lcdMap[i].type == '.') ? lcdMap[i].u.p.a :
+					      offsetof(struct yld_status, lcd);
+		frame[i] = has_feature(yld->model, a) ? buf[i] : '\t';
+	}
+	/* the whole frame is in the master status before a packet is sent */
+	yld_cycle_lock(yld);
+	setChars(yld, 0, frame, len);
+	yld_cycle_unlock(yld);
+
+	if (poke_update_from_userspace(yld) != 0)
+		ret = -ERESTARTSYS;
+
+	yld_sysfs_put(yld, 1);
+	return ret;
+}
+
 /* Interface to visible and audible "icons", these include:
  * pictures on the LCD, the LED, and the dialtone signal.
  */
 
-/* Get a list of "switchable elements" with their current state. */
-static ssize_t get_icons(struct device *dev, struct device_attribute *attr,
+/* Get a list of "switchable elements" with their current state. */
+static ssize_t get_icons(struct device *dev, struct device_attribute *attr,
+			char *buf)
+{
+	struct yealink_dev *yld;
+	int i, ret = 1;
+
+	yld = yld_sysfs_get(dev, 0);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+
+	for (i = 0; i < ARRAY_SIZE(lcdMap); i++) {
+		if ((lcdMap[i].type != '.') ||
+		    !has_feature(yld->model, lcdMap[i].u.p.a))
+			continue;
+		ret += sprintf(&buf[ret], "%s %s\n",
+				yld->lcdMap[i] == ' ' ? "  " : "on",
+				lcdMap[i].u.p.name);
+	}
+	yld_sysfs_put(yld, 0);
+	return ret;
+}
+
+/* Change the visibility of a particular element. */
+static ssize_t set_icon(struct device *dev, const char *buf, size_t count,
+			int chr)
+{
+	struct yealink_dev *yld;
+	int i, poke;
+	int ret = count;
+
+	yld = yld_sysfs_get(dev, 1);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+
+	poke = 0;
+	for (i = 0; i < ARRAY_SIZE(lcdMap); i++) {
+		if ((lcdMap[i].type != '.') ||
+		    !has_feature(yld->model, lcdMap[i].u.p.a))
+			continue;
+		if (strncmp(buf, lcdMap[i].u.p.name, count) == 0) {
+			setChar(yld, i, chr);
+			poke = 1;
+			break;
+		}
+	}
+
+	if (poke)
+		if (poke_update_from_userspace(yld) != 0)
+			ret = -ERESTARTSYS;
+
+	yld_sysfs_put(yld, 1);
+
+	return ret;
+}
+
+static ssize_t show_icon(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	return set_icon(dev, buf, count, buf[0]);
+}
+
+static ssize_t hide_icon(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	return set_icon(dev, buf, count, ' ');
+}
+
+/* Upload a ringtone to the device.
+ */
+
+/* Stores raw ringtone data in the phone */
+static ssize_t store_ringtone(struct device *dev,
+		struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	struct yealink_dev *yld;
+	int ret = count;
+
+	yld = yld_sysfs_get(dev, 1);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+	if (!has_feature(yld->model, offsetof(struct yld_status, ringnote_mod))) {
+		yld_sysfs_put(yld, 1);
+		return ret;
+	}
+
+	/* the update cycle picks up the new notes at the next sequence */
+	set_ringnotes(yld, (char *)buf, count, -1);
+	set_status_byte(yld, offsetof(struct yld_status, ringnote_mod),
+			yld->master.s.ringnote_mod + 1);
+	if (poke_update_from_userspace(yld) != 0)
+		ret = -ERESTARTSYS;
+
+	yld_sysfs_put(yld, 1);
+	return ret;
+}
+
+/* Ringtone slots.
+ *
+ * ringtone_slot0..3 cache raw ringtones (same format as ringtone) without
+ * sending them. Writing a slot number to ringtone_select installs that
+ * ringtone, the ring notes are only sent again if the phone does not
+ * already hold them. Reading ringtone_select returns the slot the phone
+ * holds, set once its ring notes were sent completely, or -1 if the
+ * ringtone was written directly.
+ */
+static ssize_t store_ringtone_slot(struct device *dev, const char *buf,
+				   size_t count, int slot)
+{
+	struct yealink_dev *yld;
+	u8 *data;
+	int i;
+
+	data = kmemdup(buf, count, GFP_KERNEL);
+	if (data == NULL)
+		return -ENOMEM;
+
+	yld = yld_sysfs_get(dev, 1);
+	if (unlikely(yld == NULL)) {
+		kfree(data);
+		return -ENODEV;
+	}
+	kfree(yld->ring_slot[slot]);
+	yld->ring_slot[slot] = data;
+	yld->ring_slot_len[slot] = count;
+	/* the phone holds the old data, send it on next select */
+	yld_cycle_lock(yld);
+	for (i = 0; i < ARRAY_SIZE(yld->notes_buf_slot); i++) {
+		if (yld->notes_buf_slot[i] == slot)
+			yld->notes_buf_slot[i] = -1;
+	}
+	if (yld->ring_slot_loaded == slot)
+		yld->ring_slot_loaded = -1;
+	yld_cycle_unlock(yld);
+	yld_sysfs_put(yld, 1);
+	return count;
+}
+
+static ssize_t store_ringtone_slot0(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	return store_ringtone_slot(dev, buf, count, 0);
+}
+
+static ssize_t store_ringtone_slot1(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	return store_ringtone_slot(dev, buf, count, 1);
+}
+
+static ssize_t store_ringtone_slot2(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	return store_ringtone_slot(dev, buf, count, 2);
+}
+
+static ssize_t store_ringtone_slot3(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	return store_ringtone_slot(dev, buf, count, 3);
+}
+
+static ssize_t show_ringtone_select(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct yealink_dev *yld;
+	ssize_t ret;
+
+	yld = yld_sysfs_get(dev, 0);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+	ret = sprintf(buf, "%d\n", READ_ONCE(yld->ring_slot_loaded));
+	yld_sysfs_put(yld, 0);
+	return ret;
+}
+
+/* Returns the slot the phone holds once the update cycle is done: the
+ * stored notes, the sequence being sent or the notes sent last.
+ */
+static int ring_slot_next(struct yealink_dev *yld)
+{
+	int slot;
+
+	yld_cycle_lock(yld);
+	if (yld->notes_pending)
+		slot = yld->notes_buf_slot[!yld->notes_cur];
+	else if (yld->notes_ix != 0 || yld->notes_wait)
+		slot = yld->notes_buf_slot[yld->notes_cur];
+	else
+		slot = yld->ring_slot_loaded;
+	yld_cycle_unlock(yld);
+	return slot;
+}
+
+static ssize_t store_ringtone_select(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct yealink_dev *yld;
+	unsigned int slot;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &slot);
+	if (ret)
+		return ret;
+	if (slot >= YEALINK_RING_SLOTS)
+		return -EINVAL;
+
+	yld = yld_sysfs_get(dev, 1);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+	ret = count;
+	if (!has_feature(yld->model, offsetof(struct yld_status, ringnote_mod))) {
+		/* no ringtone support */
+	} else if (yld->ring_slot[slot] == NULL) {
+		ret = -ENOENT;
+	} else if (ring_slot_next(yld) != slot) {
+		set_ringnotes(yld, yld->ring_slot[slot],
+			      yld->ring_slot_len[slot], slot);
+		set_status_byte(yld, offsetof(struct yld_status, ringnote_mod),
+				yld->master.s.ringnote_mod + 1);
+		if (poke_update_from_userspace(yld) != 0)
+			ret = -ERESTARTSYS;
+	}
+	yld_sysfs_put(yld, 1);
+	return ret;
+}
+
+/* Get the name of the detected phone model. */
+static ssize_t show_model(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct yealink_dev *yld;
+
+	yld = yld_sysfs_get(dev, 0);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+
+	if (yld->model)
+		strcpy(buf, yld->model->name);
+	else
+		strcpy(buf, "unknown");
+	strcat(buf, "\n");
+	yld_sysfs_put(yld, 0);
+	return strlen(buf)+1;
+}
+
+/* Interface to the adaptive key/hook polling (G1 phones only).
+ *
+ * poll_slow_ms is the idle polling delay, poll_fast_ms the delay used for
+ * poll_hold_ms after any key, hook or PSTN ring change. All values are in
+ * milliseconds, rounded to timer ticks. scan_count returns the number of
+ * key/hook scans issued so far.
+ */
+static ssize_t show_poll(struct device *dev, char *buf, size_t field)
+{
+	struct yealink_dev *yld;
+	unsigned long val;
+
+	yld = yld_sysfs_get(dev, 0);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+	val = *(unsigned long *)((u8 *)yld + field);
+	yld_sysfs_put(yld, 0);
+	return sprintf(buf, "%u\n", jiffies_to_msecs(val));
+}
+
+static ssize_t store_poll(struct device *dev, const char *buf, size_t count,
+			  size_t field)
+{
+	struct yealink_dev *yld;
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val == 0 || val > 60000)
+		return -EINVAL;
+
+	yld = yld_sysfs_get(dev, 1);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+	/* G2 phones are not polled */
+	if (yld->model->protocol == yld_ctl_protocol_g1)
+		*(unsigned long *)((u8 *)yld + field) = msecs_to_jiffies(val);
+	yld_sysfs_put(yld, 1);
+	return count;
+}
+
+static ssize_t show_poll_slow(struct device *dev, struct device_attribute *attr,
+			char *buf)
+{
+	return show_poll(dev, buf, offsetof(struct yealink_dev, timer_delay));
+}
+
+static ssize_t store_poll_slow(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	return store_poll(dev, buf, count,
+			  offsetof(struct yealink_dev, timer_delay));
+}
+
+static ssize_t show_poll_fast(struct device *dev, struct device_attribute *attr,
+			char *buf)
+{
+	return show_poll(dev, buf, offsetof(struct yealink_dev, poll_fast_delay));
+}
+
+static ssize_t store_poll_fast(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	return store_poll(dev, buf, count,
+			  offsetof(struct yealink_dev, poll_fast_delay));
+}
+
+static ssize_t show_poll_hold(struct device *dev, struct device_attribute *attr,
+			char *buf)
+{
+	return show_poll(dev, buf, offsetof(struct yealink_dev, poll_hold));
+}
+
+static ssize_t store_poll_hold(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	return store_poll(dev, buf, count,
+			  offsetof(struct yealink_dev, poll_hold));
+}
+
+/* Interface to the PSTN ring cadence detector (B2K, B3G), see ring_sample().
+ * pstn_ring_debounce_ms and pstn_ring_end_ms are in milliseconds, rounded
+ * to timer ticks. pstn_auto selects the PSTN line when an incoming call is
+ * detected.
+ */
+static ssize_t store_ring_time(struct device *dev, const char *buf,
+			       size_t count, size_t field)
+{
+	struct yealink_dev *yld;
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val == 0 || val > 60000)
+		return -EINVAL;
+
+	yld = yld_sysfs_get(dev, 1);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+	/* only the B2K and B3G have a PSTN line */
+	if (has_feature(yld->model, offsetof(struct yld_status, pstn)))
+		*(unsigned long *)((u8 *)yld + field) = msecs_to_jiffies(val);
+	yld_sysfs_put(yld, 1);
+	return count;
+}
+
+static ssize_t show_ring_debounce(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	return show_poll(dev, buf, offsetof(struct yealink_dev, ring_debounce));
+}
+
+static ssize_t store_ring_debounce(struct device *dev,
+			struct device_attribute *attr, const char *buf, size_t count)
+{
+	return store_ring_time(dev, buf, count,
+			       offsetof(struct yealink_dev, ring_debounce));
+}
+
+static ssize_t show_ring_end(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	return show_poll(dev, buf, offsetof(struct yealink_dev, ring_end));
+}
+
+static ssize_t store_ring_end(struct device *dev,
+			struct device_attribute *attr, const char *buf, size_t count)
+{
+	return store_ring_time(dev, buf, count,
+			       offsetof(struct yealink_dev, ring_end));
+}
+
+static ssize_t show_pstn_auto(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	struct yealink_dev *yld;
+	ssize_t ret;
+
+	yld = yld_sysfs_get(dev, 0);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+	ret = sprintf(buf, "%d\n", yld->pstn_auto);
+	yld_sysfs_put(yld, 0);
+	return ret;
+}
+
+static ssize_t store_pstn_auto(struct device *dev,
+			struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct yealink_dev *yld;
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val > 1)
+		return -EINVAL;
+
+	yld = yld_sysfs_get(dev, 1);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+	yld->pstn_auto = val;
+	yld_sysfs_put(yld, 1);
+	return count;
+}
+
+static ssize_t show_scan_count(struct device *dev, struct device_attribute *attr,
 			char *buf)
 {
 	struct yealink_dev *yld;
-	int i, ret = 1;
+	ssize_t ret;
 
-	down_read(&sysfs_rwsema);
-	yld = dev_get_drvdata(dev);
-	if (unlikely(yld == NULL)) {
-		up_read(&sysfs_rwsema);
+	yld = yld_sysfs_get(dev, 0);
+	if (unlikely(yld == NULL))
 		return -ENODEV;
-	}
-
-	for (i = 0; i < ARRAY_SIZE(lcdMap); i++) {
-		if ((lcdMap[i].type != '.') ||
-		    !yld->model->fcheck(lcdMap[i].u.p.a))
-			continue;
-		ret += sprintf(&buf[ret], "%s %s\n",
-				yld->lcdMap[i] == ' ' ? "  " : "on",
-				lcdMap[i].u.p.name);
-	}
-	up_read(&sysfs_rwsema);
+	ret = sprintf(buf, "%lu\n", yld->scan_count);
+	yld_sysfs_put(yld, 0);
 	return ret;
 }
 
-/* Change the visibility of a particular element. */
-static ssize_t set_icon(struct device *dev, const char *buf, size_t count,
-			int chr)
+/* Interface to the gap between two commands (G2 phones only).
+ *
+ * The value is in microseconds. Smaller values speed up LCD updates, but
+ * the handset may drop or garble commands if it is too short.
+ */
+static ssize_t show_cmd_gap(struct device *dev, struct device_attribute *attr,
+			char *buf)
 {
 	struct yealink_dev *yld;
-	int i, poke;
-	int ret = count;
+	ssize_t ret;
 
-	down_write(&sysfs_rwsema);
-	yld = dev_get_drvdata(dev);
-	if (unlikely(yld == NULL)) {
-		up_write(&sysfs_rwsema);
+	yld = yld_sysfs_get(dev, 0);
+	if (unlikely(yld == NULL))
 		return -ENODEV;
-	}
-
-	poke = 0;
-	for (i = 0; i < ARRAY_SIZE(lcdMap); i++) {
-		if ((lcdMap[i].type != '.') ||
-		    !yld->model->fcheck(lcdMap[i].u.p.a))
-			continue;
-		if (strncmp(buf, lcdMap[i].u.p.name, count) == 0) {
-			setChar(yld, i, chr);
-			poke = 1;
-			break;
-		}
-	}
-
-	if (poke)
-		if (poke_update_from_userspace(yld) != 0)
-			ret = -ERESTARTSYS;
-
-	up_write(&sysfs_rwsema);
-
+	ret = sprintf(buf, "%u\n", yld->cmd_gap_us);
+	yld_sysfs_put(yld, 0);
 	return ret;
 }
 
-static ssize_t show_icon(struct device *dev, struct device_attribute *attr,
-		const char *buf, size_t count)
+static ssize_t store_cmd_gap(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
 {
-	return set_icon(dev, buf, count, buf[0]);
-}
+	struct yealink_dev *yld;
+	unsigned int val;
+	int ret;
 
-static ssize_t hide_icon(struct device *dev, struct device_attribute *attr,
-		const char *buf, size_t count)
-{
-	return set_icon(dev, buf, count, ' ');
+	ret = kstrtouint(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val == 0 || val >= USEC_PER_SEC)
+		return -EINVAL;
+
+	yld = yld_sysfs_get(dev, 1);
+	if (unlikely(yld == NULL))
+		return -ENODEV;
+	/* G1 phones accept commands back-to-back */
+	if (yld->model->protocol == yld_ctl_protocol_g2)
+		yld->cmd_gap_us = val;
+	yld_sysfs_put(yld, 1);
+	return count;
 }
 
-/* Upload a ringtone to the device.
+/* Interface to the update completion.
+ *
+ * update_gen counts the updates from userspace which have completely reached
+ * the device, it can be watched with poll()/select(). A write to flush
+ * blocks until all pending changes have been sent.
  */
-
-/* Stores raw ringtone data in the phone */
-static ssize_t store_ringtone(struct device *dev,
-		struct device_attribute *attr,
-		const char *buf, size_t count)
+static ssize_t show_update_gen(struct device *dev, struct device_attribute *attr,
+			char *buf)
 {
 	struct yealink_dev *yld;
-	int stopped;
-	int i;
-	int ret = count;
+	unsigned long gen;
 
-	down_write(&sysfs_rwsema);
-	yld = dev_get_drvdata(dev);
-	if (unlikely(yld == NULL)) {
-		up_write(&sysfs_rwsema);
+	yld = yld_sysfs_get(dev, 0);
+	if (unlikely(yld == NULL))
 		return -ENODEV;
-	}
-	if (!yld->model->fcheck(offsetof(struct yld_status, ringnote_mod))) {
-		up_write(&sysfs_rwsema);
-		return ret;
-	}
-
-	/* first stop the whole USB cycle */
-	YEALINK_DBG_FLAGS("R:");
-	yld->usb_pause = 1;
-	smp_wmb();
-	i = 10;
-	while (i-- > 0) {
-		spin_lock_irq(&yld->flags_lock);
-		stopped = !yld->scan_active && !yld->update_active;
-		spin_unlock_irq(&yld->flags_lock);
-		if (stopped)
-			break;
-		msleep_interruptible(50);
-	}
-	YEALINK_DBG_FLAGS("  ");
-
-	/* now write the ringnotes and restart USB transfers */
-	if (stopped) {
-		set_ringnotes(yld, (char *)buf, count);
-		yld->master.s.ringnote_mod++;
-		yld->usb_pause = 0;
-		smp_wmb();		/* needed ? */
-		if (poke_update_from_userspace(yld) != 0)
-			ret = -ERESTARTSYS;
-	} else {
-		yld->usb_pause = 0;
-		dev_err(&yld->intf->dev, "Could not stop update cycle to write ringnotes!");
-	}
+	gen = READ_ONCE(yld->update_gen);
+	yld_sysfs_put(yld, 0);
+	return sprintf(buf, "%lu\n", gen);
+}
 
-	up_write(&sysfs_rwsema);
-	return ret;
+/* Returns non-zero if there are no pending changes or the phone is gone */
+static int update_flushed(struct yealink_dev *yld)
+{
+	if (usb_get_intfdata(yld->intf) == NULL)
+		return 1;
+	return !(READ_ONCE(yld->state) & (BIT(YLD_UPDATE_REQ) |
+		 BIT(YLD_UPDATE_WAIT))) &&
+	       bitmap_empty(yld->dirty, sizeof(struct yld_status));
 }
 
-/* Get the name of the detected phone model. */
-static ssize_t show_model(struct device *dev, struct device_attribute *attr,
-			  char *buf)
+static ssize_t store_flush(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
 {
 	struct yealink_dev *yld;
+	long ret;
 
-	down_read(&sysfs_rwsema);
-	yld = dev_get_drvdata(dev);
-	if (unlikely(yld == NULL)) {
-		up_read(&sysfs_rwsema);
+	/* do not hold the sysfs lock while waiting */
+	yld = yld_get(dev);
+	if (unlikely(yld == NULL))
 		return -ENODEV;
-	}
 
-	if (yld->model)
-		strcpy(buf, yld->model->name);
-	else
-		strcpy(buf, "unknown");
-	strcat(buf, "\n");
-	up_read(&sysfs_rwsema);
-	return strlen(buf)+1;
+	ret = wait_event_interruptible_timeout(yld->update_wq,
+			update_flushed(yld),
+			msecs_to_jiffies(YEALINK_FLUSH_TIMEOUT));
+	if (ret == 0)
+		ret = -ETIMEDOUT;
+	else if (ret > 0)
+		ret = (usb_get_intfdata(yld->intf) == NULL) ? -ENODEV : count;
+
+	yld_put(yld);
+	return ret;
 }
 
 /* In order to prevent information leaks, only allow user and group access */
@@ -1704,22 +3247,54 @@ static DEVICE_ATTR(map_seg7	, _M660, show_map	, store_map	);
 static DEVICE_ATTR(line1	, _M660, show_line1	, store_line1	);
 static DEVICE_ATTR(line2	, _M660, show_line2	, store_line2	);
 static DEVICE_ATTR(line3	, _M660, show_line3	, store_line3	);
+static DEVICE_ATTR(frame	, _M660, show_frame	, store_frame	);
 static DEVICE_ATTR(get_icons	, _M440, get_icons	, NULL		);
 static DEVICE_ATTR(show_icon	, _M220, NULL		, show_icon	);
 static DEVICE_ATTR(hide_icon	, _M220, NULL		, hide_icon	);
 static DEVICE_ATTR(ringtone	, _M220, NULL		, store_ringtone);
+static DEVICE_ATTR(ringtone_slot0, _M220, NULL		, store_ringtone_slot0);
+static DEVICE_ATTR(ringtone_slot1, _M220, NULL		, store_ringtone_slot1);
+static DEVICE_ATTR(ringtone_slot2, _M220, NULL		, store_ringtone_slot2);
+static DEVICE_ATTR(ringtone_slot3, _M220, NULL		, store_ringtone_slot3);
+static DEVICE_ATTR(ringtone_select, _M660, show_ringtone_select, store_ringtone_select);
 static DEVICE_ATTR(model	, _M440, show_model	, NULL		);
+static DEVICE_ATTR(poll_slow_ms	, _M660, show_poll_slow	, store_poll_slow);
+static DEVICE_ATTR(poll_fast_ms	, _M660, show_poll_fast	, store_poll_fast);
+static DEVICE_ATTR(poll_hold_ms	, _M660, show_poll_hold	, store_poll_hold);
+static DEVICE_ATTR(pstn_ring_debounce_ms, _M660, show_ring_debounce, store_ring_debounce);
+static DEVICE_ATTR(pstn_ring_end_ms, _M660, show_ring_end	, store_ring_end);
+static DEVICE_ATTR(pstn_auto	, _M660, show_pstn_auto	, store_pstn_auto);
+static DEVICE_ATTR(scan_count	, _M440, show_scan_count, NULL		);
+static DEVICE_ATTR(cmd_gap_us	, _M660, show_cmd_gap	, store_cmd_gap	);
+static DEVICE_ATTR(update_gen	, _M440, show_update_gen, NULL		);
+static DEVICE_ATTR(flush	, _M220, NULL		, store_flush	);
 
 static struct attribute *yld_attributes[] = {
 	&dev_attr_line1.attr,
 	&dev_attr_line2.attr,
 	&dev_attr_line3.attr,
+	&dev_attr_frame.attr,
 	&dev_attr_get_icons.attr,
 	&dev_attr_show_icon.attr,
 	&dev_attr_hide_icon.attr,
 	&dev_attr_map_seg7.attr,
 	&dev_attr_ringtone.attr,
+	&dev_attr_ringtone_slot0.attr,
+	&dev_attr_ringtone_slot1.attr,
+	&dev_attr_ringtone_slot2.attr,
+	&dev_attr_ringtone_slot3.attr,
+	&dev_attr_ringtone_select.attr,
 	&dev_attr_model.attr,
+	&dev_attr_poll_slow_ms.attr,
+	&dev_attr_poll_fast_ms.attr,
+	&dev_attr_poll_hold_ms.attr,
+	&dev_attr_pstn_ring_debounce_ms.attr,
+	&dev_attr_pstn_ring_end_ms.attr,
+	&dev_attr_pstn_auto.attr,
+	&dev_attr_scan_count.attr,
+	&dev_attr_cmd_gap_us.attr,
+	&dev_attr_update_gen.attr,
+	&dev_attr_flush.attr,
 	NULL
 };
 
@@ -1727,6 +3302,262 @@ static struct attribute_group yld_attr_group = {
 	.attrs = yld_attributes
 };
 
+/*******************************************************************************
+ * Character device interface
+ ******************************************************************************/
+
+/* /dev/yealinkN exists for phones with an LCD. mmap() maps a page whose
+ * first YEALINK_FB_SIZE bytes are the raw LCD segment bytes, the ioctl
+ * YEALINK_IOC_COMMIT copies them into the device state and starts a single
+ * update. The lineX attributes do not reflect changes made this way.
+ */
+static struct usb_driver yealink_driver;
+
+static int yld_fb_open(struct inode *inode, struct file *file)
+{
+	struct usb_interface *intf;
+	struct yealink_dev *yld;
+
+	intf = usb_find_interface(&yealink_driver, iminor(inode));
+	if (intf == NULL)
+		return -ENODEV;
+	yld = yld_get(&intf->dev);
+	if (yld == NULL)
+		return -ENODEV;
+	file->private_data = yld;
+	return 0;
+}
+
+static int yld_fb_release(struct inode *inode, struct file *file)
+{
+	yld_put(file->private_data);
+	return 0;
+}
+
+static int yld_fb_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct yealink_dev *yld = file->private_data;
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(yld->fb));
+}
+
+static int yld_fb_commit(struct yealink_dev *yld)
+{
+	int i, ret;
+
+	BUILD_BUG_ON(YEALINK_FB_SIZE != sizeof_field(struct yld_status, lcd));
+
+	ret = yld_lock(yld, 1);
+	if (ret)
+		return ret;
+
+	yld_cycle_lock(yld);
+	for (i = 0; i < YEALINK_FB_SIZE; i++)
+		set_status_byte(yld, offsetof(struct yld_status, lcd) + i,
+				yld->fb[i]);
+	/* the chars in lcdMap[] no longer describe the LCD */
+	bitmap_fill(yld->lcd_stale, ARRAY_SIZE(lcdMap));
+	yld_cycle_unlock(yld);
+
+	if (poke_update_from_userspace(yld) != 0)
+		ret = -ERESTARTSYS;
+
+	yld_unlock(yld, 1);
+	return ret;
+}
+
+static long yld_fb_ioctl(struct file *file, unsigned int cmd,
+			 unsigned long arg)
+{
+	switch (cmd) {
+	case YEALINK_IOC_COMMIT:
+		return yld_fb_commit(file->private_data);
+	}
+	return -ENOTTY;
+}
+
+static const struct file_operations yld_fb_fops = {
+	.owner		= THIS_MODULE,
+	.open		= yld_fb_open,
+	.release	= yld_fb_release,
+	.mmap		= yld_fb_mmap,
+	.unlocked_ioctl	= yld_fb_ioctl,
+	.compat_ioctl	= yld_fb_ioctl,
+	.llseek		= noop_llseek,
+};
+
+static struct usb_class_driver yld_class = {
+	.name		= "yealink%d",
+	.fops		= &yld_fb_fops,
+	.minor_base	= YEALINK_MINOR_BASE,
+};
+
+/*******************************************************************************
+ * debugfs interface
+ ******************************************************************************/
+
+/* Per device latency histograms in /sys/kernel/debug/yealink/<interface>/:
+ *
+ * scan_latency		key/hook scan request until its reply (G1 only)
+ * key_latency		scan detecting a key/hook change until the input
+ *			event is reported (G1 only)
+ * update_latency	first change from userspace until the last update
+ *			packet was sent to the device
+ * reset		writing anything clears all histograms
+ *
+ * and the traffic and error counters:
+ *
+ * counters		packets per command code, bytes and errors
+ */
+static struct dentry *yld_debugfs_root;
+
+static int hist_show(struct seq_file *s, void *unused)
+{
+	struct yld_histogram *h = s->private;
+	unsigned long count, total = 0;
+	int i;
+
+	seq_printf(s, "%10s %10s %10s\n", "from [us]", "to [us]", "count");
+	for (i = 0; i < YLD_HIST_BUCKETS; i++) {
+		count = atomic_long_read(&h->count[i]);
+		total += count;
+		if (i == YLD_HIST_BUCKETS - 1)
+			seq_printf(s, "%10lu %10s %10lu\n",
+				   1UL << (i - 1), "-", count);
+		else
+			seq_printf(s, "%10lu %10lu %10lu\n",
+				   i ? 1UL << (i - 1) : 0, 1UL << i,
+				   count);
+	}
+	seq_printf(s, "%21s %10lu\n", "total", total);
+	return 0;
+}
+
+static int hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hist_show, inode->i_private);
+}
+
+static const struct file_operations hist_fops = {
+	.owner		= THIS_MODULE,
+	.open		= hist_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static ssize_t hist_reset_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct yealink_dev *yld = file->private_data;
+
+	hist_reset(&yld->lat_scan);
+	hist_reset(&yld->lat_key);
+	hist_reset(&yld->lat_update);
+	return count;
+}
+
+static int hist_reset_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+static const struct file_operations hist_reset_fops = {
+	.owner		= THIS_MODULE,
+	.open		= hist_reset_open,
+	.write		= hist_reset_write,
+	.llseek		= noop_llseek,
+};
+
+static const char *const cmd_names[256] = {
+	[CMD_INIT]		= "INIT",
+	[CMD_VERSION]		= "VERSION",
+	[CMD_HANDSET]		= "HANDSET",
+	[CMD_KEYPRESS]		= "KEYPRESS",
+	[CMD_SCANCODE]		= "SCANCODE",
+	[CMD_LCD]		= "LCD",
+	[CMD_LED]		= "LED",
+	[CMD_RING_VOLUME]	= "RING_VOLUME",
+	[CMD_SPEAKER]		= "SPEAKER",
+	[CMD_RING_NOTE]		= "RING_NOTE",
+	[CMD_RINGTONE]		= "RINGTONE",
+	[CMD_DIALTONE]		= "DIALTONE",
+	[CMD_LCD_BACKLIGHT]	= "LCD_BACKLIGHT",
+	[CMD_B2K_RING]		= "B2K_RING",
+	[CMD_PSTN_SWITCH]	= "PSTN_SWITCH",
+	[STATE_BAD_PKT]		= "BAD_PKT",
+};
+
+static int counters_show(struct seq_file *s, void *unused)
+{
+	struct yld_counters *c = s->private;
+	unsigned long tx, rx;
+	int i;
+
+	seq_printf(s, "%-16s %10s %10s\n", "cmd", "tx", "rx");
+	for (i = 0; i < 256; i++) {
+		tx = atomic_long_read(&c->tx_pkts[i]);
+		rx = atomic_long_read(&c->rx_pkts[i]);
+		if (tx == 0 && rx == 0)
+			continue;
+		seq_printf(s, "0x%02x %-11s %10lu %10lu\n", i,
+			   cmd_names[i] ? cmd_names[i] : "", tx, rx);
+	}
+	seq_printf(s, "%-16s %10lu %10lu\n", "bytes",
+		   atomic_long_read(&c->tx_bytes),
+		   atomic_long_read(&c->rx_bytes));
+	seq_printf(s, "\n");
+	seq_printf(s, "csum_err    %10lu\n", atomic_long_read(&c->csum_err));
+	seq_printf(s, "bad_pkt     %10lu\n", atomic_long_read(&c->bad_pkt));
+	seq_printf(s, "unexpected  %10lu\n", atomic_long_read(&c->unexpected));
+	seq_printf(s, "ctl_urb_err %10lu\n", atomic_long_read(&c->ctl_urb_err));
+	seq_printf(s, "irq_urb_err %10lu\n", atomic_long_read(&c->irq_urb_err));
+	seq_printf(s, "retries     %10lu\n", atomic_long_read(&c->retries));
+	seq_printf(s, "timer_late  %10lu\n", atomic_long_read(&c->timer_late));
+	seq_printf(s, "keys_missed %10lu\n", atomic_long_read(&c->keys_missed));
+	seq_printf(s, "keys_lost   %10lu\n", atomic_long_read(&c->keys_lost));
+	return 0;
+}
+
+static int counters_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, counters_show, inode->i_private);
+}
+
+static const struct file_operations counters_fops = {
+	.owner		= THIS_MODULE,
+	.open		= counters_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void yld_debugfs_init(struct yealink_dev *yld)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir(dev_name(&yld->intf->dev), yld_debugfs_root);
+	yld->debugfs_dir = dir;
+	debugfs_create_file("scan_latency", S_IRUSR, dir, &yld->lat_scan,
+			    &hist_fops);
+	debugfs_create_file("key_latency", S_IRUSR, dir, &yld->lat_key,
+			    &hist_fops);
+	debugfs_create_file("update_latency", S_IRUSR, dir, &yld->lat_update,
+			    &hist_fops);
+	debugfs_create_file("reset", S_IWUSR, dir, yld, &hist_reset_fops);
+	debugfs_create_file("counters", S_IRUSR, dir, &yld->cnt,
+			    &counters_fops);
+}
+
+static void yld_debugfs_exit(struct yealink_dev *yld)
+{
+	debugfs_remove_recursive(yld->debugfs_dir);
+	yld->debugfs_dir = NULL;
+}
+
 /*******************************************************************************
  * Initialization / shutdown of the device
  ******************************************************************************/
@@ -1743,6 +3574,10 @@ static int update_version_init(struct yealink_dev *yld)
 	proto = yld->model->protocol;
 	len = USB_PKT_LEN(proto);
 
+	/* INIT clears the ring notes of the phone */
+	yld->notes_dev_valid = 0;
+	yld->ring_slot_loaded = -1;
+
 	ctl_data = kmalloc(len, GFP_KERNEL);
 	if (!ctl_data)
 		return -ENOMEM;
@@ -1804,7 +3639,8 @@ static int update_version_init(struct yealink_dev *yld)
 
 	/* P1KH: Delay the next command to avoid 0xfd error responses! */
 	if (proto == yld_ctl_protocol_g2)
-		msleep_interruptible(4 * YEALINK_COMMAND_DELAY_G2);
+		usleep_range(4000 * YEALINK_COMMAND_DELAY_G2,
+			     4000 * YEALINK_COMMAND_DELAY_G2 + 1000);
 
 	ret = submit_cmd_int_sync(yld, ctl_data, len, int_data, len);
 	if (ret != 0)
@@ -1822,17 +3658,16 @@ static int update_version_init(struct yealink_dev *yld)
 	}
 	dev_info(&yld->intf->dev, "Serial Number %s", yld->uniq+4);
 
-	/* calculate the model-specific timer delay */
-	if (proto == yld_ctl_protocol_g1) {
-		yld->timer_delay = YEALINK_POLLING_DELAY;
-		if ((yld->model->name == b2k_model) ||
-		    (yld->model->name == p4k_model))
-			yld->timer_delay /= 2;		/* double scan freq. */
-	} else { /* yld_ctl_protocol_g2 */
-		yld->timer_delay = YEALINK_COMMAND_DELAY_G2;
+	/* calculate the model-specific timer delays, keep any values
+	 * configured via sysfs across a reset */
+	if (proto == yld_ctl_protocol_g1 && yld->timer_delay == 0) {
+		yld->timer_delay = DIV_ROUND_UP(HZ * yld->model->poll_ms, 1000);
+		yld->poll_fast_delay =
+			DIV_ROUND_UP(HZ * YEALINK_POLLING_DELAY_FAST, 1000);
+		yld->poll_hold = msecs_to_jiffies(YEALINK_POLLING_HOLD);
+	} else if (proto == yld_ctl_protocol_g2 && yld->cmd_gap_us == 0) {
+		yld->cmd_gap_us = YEALINK_COMMAND_DELAY_G2 * 1000;
 	}
-	/* calculate ticks */
-	yld->timer_delay = DIV_ROUND_UP(HZ * yld->timer_delay, 1000);
 
 leave_clean:
         kfree(int_data);
@@ -1840,23 +3675,50 @@ leave_clean:
 	return ret;
 }
 
+/* Force all state to be sent to the device again.
+ * Must be called while USB traffic is stopped.
+ */
 static void restore_state(struct yealink_dev *yld)
 {
+	int ix = offsetof(struct yld_status, ringnote_mod);
 	int i;
 
 	/* force updates to device */
 	for (i = 0; i < sizeof(yld->master); i++)
 		yld->copy.b[i] = ~yld->master.b[i];
+	bitmap_fill(yld->dirty, sizeof(yld->master));
+
+	/* skip the ring notes if the phone still holds the same melody */
+	yld_cycle_lock(yld);
+	check_notes_sent(yld);
+	yld->notes_wait = 0;	/* a sequence cut short is not valid */
+	yld->notes_err = 0;
+	yld->notes_again = 0;
+	switch_ring_notes(yld);
+	if (yld->notes_dev_valid && yld->ring_notes &&
+	    yld->notes_dev_hash == yld->notes_buf_hash[yld->notes_cur]) {
+		yld->copy.b[ix] = yld->master.b[ix];
+		clear_bit(ix, yld->dirty);
+	}
+	yld_cycle_unlock(yld);
 	yld->key_code = -1;
+	yld->key_seq_valid = 0;
 	yld->last_cmd = CMD_KEYPRESS;
 	yld->hookstate = 0;
 	yld->stat_ix = 0;
 	yld->notes_ix = 0;
+	yld->poll_fast_until = jiffies;
+	yld->key_start = ktime_set(0, 0);
+	yld->update_start = ktime_set(0, 0);
+	yld->ctl_busy = 0;
+	yld->ctl_next = 0;
 	/* flags */
-	yld->scan_active = 0;
-	yld->update_active = 0;
-	yld->timer_expired = 0;
-	yld->usb_pause = 0;
+	yld_clear(yld, YLD_SCAN_ACTIVE);
+	yld_clear(yld, YLD_UPDATE_ACTIVE);
+	yld_clear(yld, YLD_TIMER_EXPIRED);
+	yld_clear(yld, YLD_USB_PAUSE);
+	yld_clear(yld, YLD_UPDATE_REQ);
+	yld_clear(yld, YLD_UPDATE_WAIT);
 }
 
 static int init_state(struct yealink_dev *yld)
@@ -1874,13 +3736,14 @@ static int init_state(struct yealink_dev *yld)
 
 	if (yld->model->protocol == yld_ctl_protocol_g1)
 	        set_ringnotes(yld, default_ringtone_g1,
-	                      sizeof(default_ringtone_g1));
+	                      sizeof(default_ringtone_g1), -1);
 	else
 	        set_ringnotes(yld, default_ringtone_g2,
-	                      sizeof(default_ringtone_g2));
+	                      sizeof(default_ringtone_g2), -1);
+	yld->ring_slot_loaded = -1;
 
 	/* switch to the PSTN line (B2K & B3G) */
-	yld->master.s.pstn = 1;
+	set_status_byte(yld, offsetof(struct yld_status, pstn), 1);
 
 	restore_state(yld);
 	return 0;
@@ -1888,24 +3751,13 @@ static int init_state(struct yealink_dev *yld)
 
 static int start_traffic(struct yealink_dev *yld, int with_key_scan)
 {
-	enum yld_ctl_protocols proto;
 	int ret = 0;
 
-	proto = yld->model->protocol;
-
-	yld->usb_pause = 0;
-	yld->timer_expired = (proto == yld_ctl_protocol_g1) ? 0 : 1;
+	yld_clear(yld, YLD_USB_PAUSE);
+	yld_clear(yld, YLD_TIMER_EXPIRED);
 
-	if (likely(!yld->shutdown)) {
-		if (with_key_scan) {
-			if (proto == yld_ctl_protocol_g1) {
-				/* start the periodic scan timer */
-				mod_timer(&yld->timer, jiffies + yld->timer_delay);
-			} else { /* yld_ctl_protocol_g2 */
-				/* immediately start waiting for a key */
-				ret = usb_submit_urb(yld->urb_irq, GFP_KERNEL);
-			}
-		}
+	if (likely(!yld_test(yld, YLD_SHUTDOWN))) {
+		ret = yld->model->engine->start(yld, with_key_scan);
 		if (ret == 0)
 			ret = poke_update_from_userspace(yld);
 	}
@@ -1914,18 +3766,15 @@ static int start_traffic(struct yealink_dev *yld, int with_key_scan)
 
 static void stop_traffic(struct yealink_dev *yld)
 {
-	yld->usb_pause = 1;
-	yld->shutdown = 1;
+	yld_set(yld, YLD_USB_PAUSE);
+	yld_set(yld, YLD_SHUTDOWN);
 	smp_wmb();			/* make sure other CPUs see this */
 
 	usb_kill_urb(yld->urb_irq);
-	usb_kill_urb(yld->urb_ctl);
-	if (yld->timer_active) {
-		del_timer_sync(&yld->timer);
-		yld->timer_active = 0;
-	}
+	kill_ctl_urbs(yld);
+	cancel_timers(yld);
 
-	yld->shutdown = 0;
+	yld_clear(yld, YLD_SHUTDOWN);
 	smp_wmb();
 }
 
@@ -1961,7 +3810,6 @@ static int input_open(struct input_dev *dev)
 	struct yealink_dev *yld = input_get_drvdata(dev);
 #endif
 	int ret;
-	int i;
 
 	dev_dbg(&yld->intf->dev, "**** input_open ****");
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19)
@@ -1974,22 +3822,16 @@ static int input_open(struct input_dev *dev)
 
 #endif
 	mutex_lock(&yld->pm_mutex);
-	i = 20;
-	while ((ret = down_trylock(&yld->usb_active_sem)) && i--) {
-		dev_dbg(&yld->intf->dev, "waiting...");
-		msleep_interruptible(100);
-	}
-	//ret = down_timeout(&yld->usb_active_sem, HZ * 2);
-	if (ret != 0) {
-		dev_err(&yld->intf->dev, "%s - cannot acquire semaphore", __FUNCTION__);
-		return -ERESTARTSYS;
-	}
-	init_state(yld);
-	yld->open = 1;
-	ret = start_traffic(yld, 1);
-	if (ret != 0) {
-		up(&yld->usb_active_sem);
-		yld->open = 0;
+	/* let the updates started while being closed finish */
+	ret = quiesce_updates(yld);
+	if (ret == 0) {
+		init_state(yld);
+		yld_set(yld, YLD_OPEN);
+		ret = start_traffic(yld, 1);
+		if (ret != 0)
+			yld_clear(yld, YLD_OPEN);
+	} else {
+		dev_err(&yld->intf->dev, "%s - update cycle did not stop", __FUNCTION__);
 	}
 	mutex_unlock(&yld->pm_mutex);
 
@@ -2010,16 +3852,13 @@ static void input_close(struct input_dev *dev)
 #endif
 
 	mutex_lock(&yld->pm_mutex);
-	yld->open = 0;
+	yld_clear(yld, YLD_OPEN);
 
 	//stop_traffic(yld);
-	yld->shutdown = 1;
+	yld_set(yld, YLD_SHUTDOWN);
 	smp_wmb();			/* make sure other CPUs see this */
-	if (yld->timer_active) {
-		del_timer_sync(&yld->timer);
-		yld->timer_active = 0;
-	}
-	yld->shutdown = 0;
+	cancel_timers(yld);
+	yld_clear(yld, YLD_SHUTDOWN);
 	smp_wmb();
 
 	mutex_unlock(&yld->pm_mutex);
@@ -2064,13 +3903,15 @@ static const struct usb_device_id usb_table [] = {
 
 static int usb_cleanup(struct yealink_dev *yld, int err)
 {
+	int i;
+
 	if (yld == NULL)
 		return err;
 
-	yld->open = 0;
-	up(&yld->usb_active_sem);
+	yld_clear(yld, YLD_OPEN);
 
 	stop_traffic(yld);
+	cancel_work_sync(&yld->notify_work);
 
         if (yld->idev) {
 		if (err)
@@ -2086,13 +3927,16 @@ static int usb_cleanup(struct yealink_dev *yld, int err)
 #else
 		kfree(yld->ctl_req);
 #endif
-	if (yld->ctl_data)
+	for (i = 0; i < YEALINK_CTL_QUEUE_LEN; i++) {
+		if (yld->ctl[i].data)
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,34)
-		usb_buffer_free(yld->udev, USB_PKT_LEN(yld->model->protocol),
+			usb_buffer_free(yld->udev, USB_PKT_LEN(yld->model->protocol),
 #else
-		usb_free_coherent(yld->udev, USB_PKT_LEN(yld->model->protocol),
+			usb_free_coherent(yld->udev, USB_PKT_LEN(yld->model->protocol),
 #endif
-		                yld->ctl_data, yld->ctl_dma);
+			                yld->ctl[i].data, yld->ctl[i].dma);
+		usb_free_urb(yld->ctl[i].urb);
+	}
 	if (yld->irq_data)
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,34)
 		usb_buffer_free(yld->udev, USB_PKT_LEN(yld->model->protocol),
@@ -2102,8 +3946,7 @@ static int usb_cleanup(struct yealink_dev *yld, int err)
 		                yld->irq_data, yld->irq_dma);
 
 	usb_free_urb(yld->urb_irq);
-	usb_free_urb(yld->urb_ctl);
-	kfree(yld);
+	kref_put(&yld->kref, yld_release);
 	return err;
 }
 
@@ -2114,6 +3957,8 @@ static int usb_suspend(struct usb_interface *intf, pm_message_t message)
 	dev_info(&intf->dev, "yealink: usb_suspend (event=%d)\n", message.event);
 
 	mutex_lock(&yld->pm_mutex);
+	/* let a running transfer finish, e.g. a ring note sequence */
+	quiesce_updates(yld);
 	stop_traffic(yld);
 	mutex_unlock(&yld->pm_mutex);
 
@@ -2159,11 +4004,18 @@ static void usb_disconnect(struct usb_interface *intf)
 {
 	struct yealink_dev *yld;
 
-	down_write(&sysfs_rwsema);
 	yld = usb_get_intfdata(intf);
-	sysfs_remove_group(&intf->dev.kobj, &yld_attr_group);
+	usb_deregister_dev(intf, &yld_class);
+
+	/* wait for the sysfs user of this device, later ones see NULL */
+	down_write(&yld->sysfs_rwsem);
 	usb_set_intfdata(intf, NULL);
-	up_write(&sysfs_rwsema);
+	up_write(&yld->sysfs_rwsem);
+	synchronize_rcu();
+	wake_up_all(&yld->update_wq);
+
+	yld_debugfs_exit(yld);
+	sysfs_remove_group(&intf->dev.kobj, &yld_attr_group);
 
 	usb_cleanup(yld, 0);
 }
@@ -2175,7 +4027,6 @@ static int usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
 	struct usb_endpoint_descriptor *endpoint;
 	struct yealink_dev *yld;
 	struct input_dev *input_dev;
-	enum yld_ctl_protocols proto;
 	int ret, pipe, i;
 	int pkt_len;
 
@@ -2188,12 +4039,31 @@ static int usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
 	if (!yld)
 		return -ENOMEM;
 
-	spin_lock_init(&yld->flags_lock);
+	/* released with the last reference, see yld_release() */
+	yld->intf = usb_get_intf(intf);
 	mutex_init(&yld->pm_mutex);
-	sema_init(&yld->usb_active_sem, 0);
+	init_rwsem(&yld->sysfs_rwsem);
+	kref_init(&yld->kref);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+	setup_timer(&yld->ring_timer, timer_callback_ring, (unsigned long) yld);
+#else
+	timer_setup(&yld->ring_timer, timer_callback_ring, 0);
+#endif
+	yld->ring_debounce = msecs_to_jiffies(YEALINK_RING_DEBOUNCE);
+	yld->ring_end = msecs_to_jiffies(YEALINK_RING_END);
+	init_waitqueue_head(&yld->update_wq);
+	init_waitqueue_head(&yld->idle_wq);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	INIT_WORK(&yld->notify_work, (void (*)(void *)) update_notify_work,
+		  &yld->notify_work);
+#else
+	INIT_WORK(&yld->notify_work, update_notify_work);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
+	init_usb_anchor(&yld->ctl_anchor);
+#endif
 
 	yld->udev = udev;
-	yld->intf = intf;
 	yld->int_endpoint = endpoint;
 
 	/* get a handle to the interrupt data pipe */
@@ -2205,10 +4075,8 @@ static int usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
 #endif
 
 	if (pkt_len == USB_PKT_LEN_G1) {
-		proto = yld_ctl_protocol_g1;
 		yld->model = &model[model_info_idx_p1k];	/* changed later */
 	} else if (pkt_len == USB_PKT_LEN_G2) {
-		proto = yld_ctl_protocol_g2;
 		yld->model = &model[model_info_idx_p1kh];
 	} else {
 		int pid = le16_to_cpu(udev->descriptor.idProduct);
@@ -2225,6 +4093,22 @@ static int usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
 	if (!input_dev)
 		return usb_cleanup(yld, -ENOMEM);
 
+	yld->seg7 = kmemdup(&map_seg7, sizeof(map_seg7), GFP_KERNEL);
+	if (yld->seg7 == NULL)
+		return usb_cleanup(yld, -ENOMEM);
+
+	for (i = 0; i < ARRAY_SIZE(yld->notes_buf); i++) {
+		yld->notes_buf[i] = kmalloc(YEALINK_RING_NOTES_MAX, GFP_KERNEL);
+		if (yld->notes_buf[i] == NULL)
+			return usb_cleanup(yld, -ENOMEM);
+	}
+
+	if (has_feature(yld->model, offsetof(struct yld_status, lcd))) {
+		yld->fb = (u8 *) get_zeroed_page(GFP_KERNEL);
+		if (yld->fb == NULL)
+			return usb_cleanup(yld, -ENOMEM);
+	}
+
 	/* allocate usb buffers */
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,34)
 	yld->irq_data = usb_buffer_alloc(udev, pkt_len,
@@ -2235,14 +4119,16 @@ static int usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
 	if (yld->irq_data == NULL)
 		return usb_cleanup(yld, -ENOMEM);
 
+	for (i = 0; i < YEALINK_CTL_QUEUE_LEN; i++) {
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,34)
-	yld->ctl_data = usb_buffer_alloc(udev, pkt_len,
+		yld->ctl[i].data = usb_buffer_alloc(udev, pkt_len,
 #else
-	yld->ctl_data = usb_alloc_coherent(udev, pkt_len,
+		yld->ctl[i].data = usb_alloc_coherent(udev, pkt_len,
 #endif
-					GFP_ATOMIC, &yld->ctl_dma);
-	if (!yld->ctl_data)
-		return usb_cleanup(yld, -ENOMEM);
+					GFP_ATOMIC, &yld->ctl[i].dma);
+		if (!yld->ctl[i].data)
+			return usb_cleanup(yld, -ENOMEM);
+	}
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,34)
 	yld->ctl_req = usb_buffer_alloc(udev, sizeof(*(yld->ctl_req)),
@@ -2258,9 +4144,11 @@ static int usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
         if (yld->urb_irq == NULL)
 		return usb_cleanup(yld, -ENOMEM);
 
-	yld->urb_ctl = usb_alloc_urb(0, GFP_KERNEL);
-        if (yld->urb_ctl == NULL)
-		return usb_cleanup(yld, -ENOMEM);
+	for (i = 0; i < YEALINK_CTL_QUEUE_LEN; i++) {
+		yld->ctl[i].urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (yld->ctl[i].urb == NULL)
+			return usb_cleanup(yld, -ENOMEM);
+	}
 
 	/* initialize irq urb */
 	usb_fill_int_urb(yld->urb_irq, udev, pipe, yld->irq_data,
@@ -2279,34 +4167,35 @@ static int usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
 	yld->ctl_req->wIndex	= cpu_to_le16(interface->desc.bInterfaceNumber);
 	yld->ctl_req->wLength	= cpu_to_le16(pkt_len);
 
-	usb_fill_control_urb(yld->urb_ctl, udev, usb_sndctrlpipe(udev, 0),
-			(void *)yld->ctl_req, yld->ctl_data, pkt_len,
-			urb_ctl_callback, yld);
+	for (i = 0; i < YEALINK_CTL_QUEUE_LEN; i++) {
+		struct yld_ctl_slot *slot = &yld->ctl[i];
+
+		slot->yld = yld;
+		usb_fill_control_urb(slot->urb, udev, usb_sndctrlpipe(udev, 0),
+				(void *)yld->ctl_req, slot->data, pkt_len,
+				urb_ctl_callback, slot);
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,34)
-	yld->urb_ctl->setup_dma	= yld->ctl_req_dma;
+		slot->urb->setup_dma	= yld->ctl_req_dma;
 #endif
-	yld->urb_ctl->transfer_dma	= yld->ctl_dma;
+		slot->urb->transfer_dma	= slot->dma;
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,34)
-	yld->urb_ctl->transfer_flags	|= URB_NO_SETUP_DMA_MAP |
-					URB_NO_TRANSFER_DMA_MAP;
+		slot->urb->transfer_flags |= URB_NO_SETUP_DMA_MAP |
+					     URB_NO_TRANSFER_DMA_MAP;
 #else
-	yld->urb_ctl->transfer_flags	|= URB_NO_TRANSFER_DMA_MAP;
+		slot->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 #endif
-	yld->urb_ctl->dev = udev;
+		slot->urb->dev = udev;
+	}
 
-	/* set up the periodic scan/update timer */
+	/* set up the periodic scan timer (G1) and the command timer (G2) */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
-	setup_timer(&yld->timer,
-		    (proto == yld_ctl_protocol_g1) ? timer_callback_g1 :
-						     timer_callback_g2,
-		    (unsigned long) yld);
+	setup_timer(&yld->timer, timer_callback_g1, (unsigned long) yld);
 #else
-	timer_setup(&yld->timer,
-		    (proto == yld_ctl_protocol_g1) ? timer_callback_g1 :
-						     timer_callback_g2,
-		    0);
+	timer_setup(&yld->timer, timer_callback_g1, 0);
 #endif
-	yld->timer_active = 1;
+	hrtimer_init(&yld->cmd_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	yld->cmd_timer.function = timer_callback_g2;
+	yld_set(yld, YLD_TIMER_ACTIVE);
 
 	/* find out the physical bus location */
 	usb_make_path(udev, yld->phys, sizeof(yld->phys));
@@ -2363,6 +4252,16 @@ static int usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
 	if (ret)
 		return usb_cleanup(yld, ret);
 
+	yld_debugfs_init(yld);
+
+	/* Register the raw LCD device last, nothing can fail after it
+	 * (don't care about failure) */
+	if (yld->fb) {
+		memcpy(yld->fb, yld->master.s.lcd, YEALINK_FB_SIZE);
+		if (usb_register_dev(intf, &yld_class))
+			dev_warn(&intf->dev, "could not register character device");
+	}
+
 	dev_dbg(&yld->intf->dev, "%s - done", __FUNCTION__);
 
 	return 0;
@@ -2385,16 +4284,22 @@ static struct usb_driver yealink_driver = {
 
 static int __init yealink_dev_init(void)
 {
-	int ret = usb_register(&yealink_driver);
+	int ret;
+
+	yld_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	ret = usb_register(&yealink_driver);
 	if (ret == 0)
 		printk(KERN_INFO KBUILD_MODNAME ": "
 			DRIVER_DESC ": " DRIVER_VERSION " (C) " DRIVER_AUTHOR "\n");
+	else
+		debugfs_remove_recursive(yld_debugfs_root);
 	return ret;
 }
 
 static void __exit yealink_dev_exit(void)
 {
 	usb_deregister(&yealink_driver);
+	debugfs_remove_recursive(yld_debugfs_root);
 }
 
 module_init(yealink_dev_init);
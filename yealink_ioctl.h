@@ -0,0 +1,36 @@
+/*
+ * drivers/usb/input/yealink_ioctl.h
+ *
+ * Userspace interface of the /dev/yealinkN character devices.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _YEALINK_IOCTL_H
+#define _YEALINK_IOCTL_H
+
+#include <linux/ioctl.h>
+
+/* The first YEALINK_FB_SIZE bytes of the page mapped by mmap() hold the raw
+ * LCD segment bytes, see the _SEG/_PIC tables in yealink.h for the meaning
+ * of each bit.
+ */
+#define YEALINK_FB_SIZE		24
+
+#define YEALINK_IOC_MAGIC	'Y'
+
+/* Send the content of the mapped page to the phone */
+#define YEALINK_IOC_COMMIT	_IO(YEALINK_IOC_MAGIC, 0)
+
+#endif /* _YEALINK_IOCTL_H */
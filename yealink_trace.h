@@ -0,0 +1,176 @@
+/*
+ * drivers/usb/input/yealink_trace.h
+ *
+ * Tracepoints for the Yealink phone driver.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM yealink
+
+#if !defined(YEALINK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define YEALINK_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/device.h>
+
+/* State of the update/scan cycle at the entry and exit of the functions
+ * driving it (poke_update_from_userspace, step_g1/g2,
+ * timer_callback_g1/g2, quiesce_updates).
+ */
+TRACE_EVENT(yealink_flags,
+	TP_PROTO(struct device *dev, const char *func, const char *tag,
+		 unsigned int scan_active, unsigned int update_active,
+		 unsigned int timer_expired, unsigned int usb_pause,
+		 unsigned int ctl_busy),
+	TP_ARGS(dev, func, tag, scan_active, update_active, timer_expired,
+		usb_pause, ctl_busy),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__string(func, func)
+		__string(tag, tag)
+		__field(u8, scan_active)
+		__field(u8, update_active)
+		__field(u8, timer_expired)
+		__field(u8, usb_pause)
+		__field(u8, ctl_busy)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__assign_str(func, func);
+		__assign_str(tag, tag);
+		__entry->scan_active = scan_active;
+		__entry->update_active = update_active;
+		__entry->timer_expired = timer_expired;
+		__entry->usb_pause = usb_pause;
+		__entry->ctl_busy = ctl_busy;
+	),
+	TP_printk("%s %s %s s=%u u=%u t=%u p=%u busy=0x%02x",
+		  __get_str(dev), __get_str(func), __get_str(tag),
+		  __entry->scan_active, __entry->update_active,
+		  __entry->timer_expired, __entry->usb_pause,
+		  __entry->ctl_busy)
+);
+
+/* Control packet handed to the USB core, offset and size are only
+ * meaningful for G1 packets.
+ */
+TRACE_EVENT(yealink_ctl_submit,
+	TP_PROTO(struct device *dev, const u8 *pkt, int len,
+		 unsigned int offset, unsigned int size, int ret),
+	TP_ARGS(dev, pkt, len, offset, size, ret),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(u8, cmd)
+		__field(u16, offset)
+		__field(u8, size)
+		__field(int, len)
+		__field(int, ret)
+		__array(u8, pkt, 16)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->cmd = pkt[0];
+		__entry->offset = offset;
+		__entry->size = size;
+		__entry->len = min(len, 16);
+		__entry->ret = ret;
+		memcpy(__entry->pkt, pkt, __entry->len);
+	),
+	TP_printk("%s cmd=0x%02x offset=%u size=%u ret=%d pkt=%s",
+		  __get_str(dev), __entry->cmd, __entry->offset,
+		  __entry->size, __entry->ret,
+		  __print_hex(__entry->pkt, __entry->len))
+);
+
+/* Completion of a control URB */
+TRACE_EVENT(yealink_ctl_complete,
+	TP_PROTO(struct device *dev, u8 cmd, int status),
+	TP_ARGS(dev, cmd, status),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(u8, cmd)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->cmd = cmd;
+		__entry->status = status;
+	),
+	TP_printk("%s cmd=0x%02x status=%d",
+		  __get_str(dev), __entry->cmd, __entry->status)
+);
+
+/* Completion of the irq URB */
+TRACE_EVENT(yealink_irq,
+	TP_PROTO(struct device *dev, u8 cmd, u8 data0, int status),
+	TP_ARGS(dev, cmd, data0, status),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(u8, cmd)
+		__field(u8, data0)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->cmd = cmd;
+		__entry->data0 = data0;
+		__entry->status = status;
+	),
+	TP_printk("%s cmd=0x%02x data0=0x%02x status=%d",
+		  __get_str(dev), __entry->cmd, __entry->data0,
+		  __entry->status)
+);
+
+/* Ring note buffers: new notes stored in the spare buffer (while the
+ * sequence in buf is at notes_ix), a buffer switched in, or the last packet
+ * of a sequence completed, with all packets sent or with a failed one.
+ * pending is set while stored notes wait for the next sequence.
+ */
+TRACE_EVENT(yealink_ring_notes,
+	TP_PROTO(struct device *dev, const char *tag, int buf, int len,
+		 u32 hash, int notes_ix, int pending),
+	TP_ARGS(dev, tag, buf, len, hash, notes_ix, pending),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__string(tag, tag)
+		__field(u8, buf)
+		__field(int, len)
+		__field(u32, hash)
+		__field(int, notes_ix)
+		__field(u8, pending)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__assign_str(tag, tag);
+		__entry->buf = buf;
+		__entry->len = len;
+		__entry->hash = hash;
+		__entry->notes_ix = notes_ix;
+		__entry->pending = pending;
+	),
+	TP_printk("%s %s buf=%u len=%d hash=0x%08x notes_ix=%d pending=%u",
+		  __get_str(dev), __get_str(tag), __entry->buf, __entry->len,
+		  __entry->hash, __entry->notes_ix, __entry->pending)
+);
+
+#endif /* YEALINK_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE yealink_trace
+#include <trace/define_trace.h>